@@ -0,0 +1,142 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ridge-saw.h"
+
+/* Tile size autotuning for random image generation.
+ *
+ * Small tiles are cheap to generate and process, but a large fraction
+ * of their lines touch the edge of the tile and are truncated.  Large
+ * tiles lose fewer lines, but may fall out of cache, and detection
+ * time may grow faster than the area.  The best size is found by
+ * timing a few calibration tiles at each candidate size, and choosing
+ * the one that yields the most usable lines, ones that don't touch the
+ * edge, per second.  The way line data is passed back from ridgetool
+ * (temporary file or pipe) is then chosen in the same way at that
+ * size.
+ *
+ * Calibration tiles have negative tile indices, so they are never the
+ * same as any tile in the full run. */
+
+#define AUTOTUNE_MIN_SIZE 256
+#define AUTOTUNE_MAX_SIZE 4096
+#define AUTOTUNE_MIN_TIME 2000000 /* Calibration time per candidate, us */
+#define AUTOTUNE_MAX_TILES 8      /* Calibration tiles per candidate */
+
+/* Count the lines that don't touch the edge of a size x size tile. */
+static guint
+autotune_count_usable (const SawLines *lines, int size)
+{
+  guint usable = 0;
+  for (guint i = 0; i < lines->num_lines; i++) {
+    guint32 k;
+    for (k = lines->offsets[i]; k < lines->offsets[i+1]; k++) {
+      gint32 row = lines->points[2*k], col = lines->points[2*k + 1];
+      if (row <= 0 || col <= 0 || row >= size - 1 || col >= size - 1) break;
+    }
+    if (k == lines->offsets[i+1]) usable++;
+  }
+  return usable;
+}
+
+/* Measure the rate of usable lines, in lines per second, from tiles
+ * of the given size. */
+static double
+autotune_measure (const char *noise_spec, int size, float scale,
+                  SawPrecision precision, gsl_rng *rng, unsigned long seed,
+                  int *next_tile)
+{
+  NoiseSource *noise = noise_source_new (noise_spec, size, size);
+  g_assert (noise);
+  RutSurface *img = saw_surface_new (size, size);
+  SawTempFile *tmp = saw_temp_file_new ();
+  if (tmp == NULL) {
+    const char *msg = errno ? strerror (errno) : "Unexpected error";
+    fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
+             msg);
+    exit (5);
+  }
+
+  gint64 start = g_get_monotonic_time ();
+  gint64 elapsed;
+  guint64 usable = 0;
+  int num_tiles = 0;
+  do {
+    noise_source_fill_tile (noise, rng, seed, (*next_tile)--, img);
+    SawLines *lines = detect_surface_lines (img, tmp->path, scale,
+                                            precision);
+    usable += autotune_count_usable (lines, size);
+    saw_lines_free (lines);
+    num_tiles++;
+    elapsed = g_get_monotonic_time () - start;
+  } while (elapsed < AUTOTUNE_MIN_TIME && num_tiles < AUTOTUNE_MAX_TILES
+           && !saw_shutdown_requested ());
+
+  saw_temp_file_free (tmp);
+  saw_surface_free (img);
+  noise_source_free (noise);
+
+  double rate = usable * 1e6 / MAX (elapsed, 1);
+  fprintf (stderr, "Autotune: size %i, %s: %i tiles, %.1f usable "
+           "lines/s\n", size, get_ridgetool_stream () ? "pipe" : "file",
+           num_tiles, rate);
+  return rate;
+}
+
+/* Choose the tile size and ridgetool transfer mode that give the most
+ * usable lines per second, and set the transfer mode. */
+void
+autotune_noise (const char *noise_spec, float scale, SawPrecision precision,
+                gsl_rng *rng, unsigned long seed, SawTuning *tuning)
+{
+  int next_tile = -1;
+  int stream = get_ridgetool_stream ();
+
+  tuning->tile_size = 0;
+  tuning->stream = stream;
+  tuning->rate = -1;
+
+  for (int size = AUTOTUNE_MIN_SIZE; size <= AUTOTUNE_MAX_SIZE; size *= 2) {
+    if (saw_shutdown_requested ()) break;
+    double rate = autotune_measure (noise_spec, size, scale, precision,
+                                    rng, seed, &next_tile);
+    if (rate > tuning->rate) {
+      tuning->tile_size = size;
+      tuning->rate = rate;
+    }
+  }
+  if (tuning->tile_size == 0) tuning->tile_size = AUTOTUNE_MIN_SIZE;
+
+  /* Try the other transfer mode at the chosen size */
+  if (!saw_shutdown_requested ()) {
+    set_ridgetool_stream (!stream);
+    double rate = autotune_measure (noise_spec, tuning->tile_size, scale,
+                                    precision, rng, seed, &next_tile);
+    if (rate > tuning->rate) {
+      tuning->stream = !stream;
+      tuning->rate = rate;
+    }
+  }
+  set_ridgetool_stream (tuning->stream);
+}
@@ -0,0 +1,337 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ridge-saw.h"
+
+/* Block bootstrap confidence intervals for <R^2>(N) and nu.
+ *
+ * Lines from the same random tile are correlated, so resampling
+ * individual lines would understate the uncertainty.  Instead, the
+ * tiles are the blocks: for each tile, only partial sums are kept,
+ * binned by step count N with bin b holding lines of 2^b to
+ * 2^(b+1) - 1 steps.  Each bootstrap replicate draws as many tiles as
+ * were processed, with replacement, and adds up their partial sums to
+ * get the mean square distance in each bin and a fit of
+ *
+ *   log <R^2> = 2 nu log N + c
+ *
+ * over the bins with enough lines, where N is the geometric mean step
+ * count of the bin.  The replicates are shared out between threads,
+ * and each is seeded from the random seed and its index, so the
+ * results don't depend on the number of threads.  Tiles finish in an
+ * order that depends on timing, so they are sorted by index before
+ * resampling, so that the results don't depend on that either.
+ * Intervals are taken from the percentiles of the replicate
+ * estimates. */
+
+#define BOOT_NUM_BINS 32
+#define BOOT_MIN_LINES 10      /* Lines needed in a bin to use it in fits */
+#define BOOT_CONFIDENCE 0.95
+
+typedef struct _SawBootEntry SawBootEntry;
+typedef struct _SawBootTile SawBootTile;
+typedef struct _SawBootWorker SawBootWorker;
+
+/* Partial sums for one bin of one tile */
+struct _SawBootEntry
+{
+  guint32 bin;
+  guint32 count;
+  double sum_log_n;
+  double sum_r2;
+};
+
+/* A tile's entries */
+struct _SawBootTile
+{
+  int tile;
+  guint32 first;
+  guint32 num_entries;
+};
+
+struct _SawBootstrap
+{
+  GArray *entries;  /* SawBootEntry, grouped by tile */
+  GArray *tiles;    /* SawBootTile */
+  GMutex mutex;
+};
+
+struct _SawBootWorker
+{
+  const SawBootstrap *boot;
+  const gboolean *fit_bins;
+  unsigned long seed;
+  int first, last;  /* Replicates to compute */
+  double *r2;       /* BOOT_NUM_BINS values per replicate */
+  double *nu;
+  GThread *thread;
+};
+
+SawBootstrap *
+saw_bootstrap_new (void)
+{
+  SawBootstrap *boot = g_new0 (SawBootstrap, 1);
+  boot->entries = g_array_new (FALSE, FALSE, sizeof (SawBootEntry));
+  boot->tiles = g_array_new (FALSE, FALSE, sizeof (SawBootTile));
+  g_mutex_init (&boot->mutex);
+  return boot;
+}
+
+void
+saw_bootstrap_free (SawBootstrap *boot)
+{
+  if (boot == NULL) return;
+  g_array_free (boot->entries, TRUE);
+  g_array_free (boot->tiles, TRUE);
+  g_mutex_clear (&boot->mutex);
+  g_free (boot);
+}
+
+static int
+saw_bootstrap_bin (guint num_steps)
+{
+  int b = 0;
+  while (num_steps > 1 && b < BOOT_NUM_BINS - 1) {
+    num_steps >>= 1;
+    b++;
+  }
+  return b;
+}
+
+/* Add the partial sums for the lines detected in the given tile.
+ * Lines of no steps are ignored.  Safe to call from several threads at
+ * once. */
+void
+saw_bootstrap_add_tile (SawBootstrap *boot, const SawLines *lines, int tile)
+{
+  SawBootEntry bins[BOOT_NUM_BINS];
+  memset (bins, 0, sizeof (bins));
+
+  for (guint i = 0; i < lines->num_lines; i++) {
+    const gint32 *start = &lines->points[2 * lines->offsets[i]];
+    const gint32 *end = &lines->points[2 * (lines->offsets[i+1] - 1)];
+    guint num_steps = lines->offsets[i+1] - lines->offsets[i] - 1;
+    if (num_steps == 0) continue;
+
+    double dx = end[1] - start[1];
+    double dy = end[0] - start[0];
+    SawBootEntry *e = &bins[saw_bootstrap_bin (num_steps)];
+    e->count++;
+    e->sum_log_n += log (num_steps);
+    e->sum_r2 += dx*dx + dy*dy;
+  }
+
+  g_mutex_lock (&boot->mutex);
+  SawBootTile t = {tile, boot->entries->len, 0};
+  for (guint32 b = 0; b < BOOT_NUM_BINS; b++) {
+    if (bins[b].count == 0) continue;
+    bins[b].bin = b;
+    g_array_append_val (boot->entries, bins[b]);
+    t.num_entries++;
+  }
+  g_array_append_val (boot->tiles, t);
+  g_mutex_unlock (&boot->mutex);
+}
+
+/* Fit log <R^2> against log N by least squares over the selected
+ * bins, and return nu, or NAN if fewer than two bins have data. */
+static double
+saw_bootstrap_fit (const double *count, const double *sum_log_n,
+                   const double *sum_r2, const gboolean *fit_bins)
+{
+  double sx = 0, sy = 0, sxx = 0, sxy = 0;
+  int n = 0;
+  for (int b = 0; b < BOOT_NUM_BINS; b++) {
+    if (!fit_bins[b] || count[b] == 0 || sum_r2[b] <= 0) continue;
+    double x = sum_log_n[b] / count[b];
+    double y = log (sum_r2[b] / count[b]);
+    sx += x;
+    sy += y;
+    sxx += x*x;
+    sxy += x*y;
+    n++;
+  }
+  double d = n * sxx - sx * sx;
+  if (n < 2 || d <= 0) return NAN;
+  return 0.5 * (n * sxy - sx * sy) / d;
+}
+
+/* Add up the partial sums of the tiles in a replicate, or of all the
+ * tiles if rng is NULL. */
+static void
+saw_bootstrap_sum (const SawBootstrap *boot, gsl_rng *rng, double *count,
+                   double *sum_log_n, double *sum_r2)
+{
+  guint num_tiles = boot->tiles->len;
+  for (int b = 0; b < BOOT_NUM_BINS; b++) {
+    count[b] = sum_log_n[b] = sum_r2[b] = 0;
+  }
+  for (guint i = 0; i < num_tiles; i++) {
+    guint t = (rng != NULL) ? gsl_rng_uniform_int (rng, num_tiles) : i;
+    const SawBootTile *tile = &g_array_index (boot->tiles, SawBootTile, t);
+    for (guint32 k = tile->first; k < tile->first + tile->num_entries; k++) {
+      const SawBootEntry *e = &g_array_index (boot->entries, SawBootEntry,
+                                              k);
+      count[e->bin] += e->count;
+      sum_log_n[e->bin] += e->sum_log_n;
+      sum_r2[e->bin] += e->sum_r2;
+    }
+  }
+}
+
+static gpointer
+saw_bootstrap_thread (gpointer user_data)
+{
+  SawBootWorker *w = (SawBootWorker *) user_data;
+  gsl_rng *rng = gsl_rng_alloc (gsl_rng_default);
+  double count[BOOT_NUM_BINS], sum_log_n[BOOT_NUM_BINS];
+  double sum_r2[BOOT_NUM_BINS];
+
+  for (int r = w->first; r < w->last; r++) {
+    gsl_rng_set (rng, w->seed + r);
+    saw_bootstrap_sum (w->boot, rng, count, sum_log_n, sum_r2);
+    for (int b = 0; b < BOOT_NUM_BINS; b++) {
+      w->r2[(gsize) r * BOOT_NUM_BINS + b] = ((count[b] > 0)
+                                              ? sum_r2[b] / count[b] : NAN);
+    }
+    w->nu[r] = saw_bootstrap_fit (count, sum_log_n, sum_r2, w->fit_bins);
+  }
+  gsl_rng_free (rng);
+  return NULL;
+}
+
+static gint
+saw_bootstrap_compare_tiles (gconstpointer a, gconstpointer b)
+{
+  int x = ((const SawBootTile *) a)->tile;
+  int y = ((const SawBootTile *) b)->tile;
+  return (x > y) - (x < y);
+}
+
+static int
+saw_bootstrap_compare (const void *a, const void *b)
+{
+  double x = *(const double *) a, y = *(const double *) b;
+  return (x > y) - (x < y);
+}
+
+/* Find the confidence interval from n replicate values, stride apart.
+ * Replicates where the value is undefined are ignored. */
+static void
+saw_bootstrap_interval (const double *values, int n, int stride,
+                        double *lo, double *hi)
+{
+  double *v = g_new (double, n);
+  int m = 0;
+  for (int i = 0; i < n; i++) {
+    double x = values[(gsize) i * stride];
+    if (!isnan (x)) v[m++] = x;
+  }
+  if (m == 0) {
+    *lo = *hi = NAN;
+  } else {
+    qsort (v, m, sizeof (double), saw_bootstrap_compare);
+    double alpha = (1 - BOOT_CONFIDENCE) / 2;
+    *lo = v[(int) floor (alpha * (m - 1))];
+    *hi = v[(int) ceil ((1 - alpha) * (m - 1))];
+  }
+  g_free (v);
+}
+
+/* Run num_replicates bootstrap replicates on num_threads threads, and
+ * write the estimates of <R^2> for each bin and of nu, with confidence
+ * intervals, to filename.  Returns 0 and sets errno on failure. */
+int
+saw_bootstrap_write (SawBootstrap *boot, const char *filename,
+                     int num_replicates, int num_threads,
+                     unsigned long seed)
+{
+  g_assert (num_replicates > 0 && num_threads > 0);
+
+  /* Replicates pick tiles by position, so put them in a fixed order */
+  g_array_sort (boot->tiles, saw_bootstrap_compare_tiles);
+
+  /* Estimates from all of the data */
+  double count[BOOT_NUM_BINS], sum_log_n[BOOT_NUM_BINS];
+  double sum_r2[BOOT_NUM_BINS];
+  gboolean fit_bins[BOOT_NUM_BINS];
+  saw_bootstrap_sum (boot, NULL, count, sum_log_n, sum_r2);
+  for (int b = 0; b < BOOT_NUM_BINS; b++) {
+    fit_bins[b] = (count[b] >= BOOT_MIN_LINES);
+  }
+  double nu = saw_bootstrap_fit (count, sum_log_n, sum_r2, fit_bins);
+
+  /* Replicates */
+  double *r2 = g_new (double, (gsize) num_replicates * BOOT_NUM_BINS);
+  double *nus = g_new (double, num_replicates);
+  num_threads = MIN (num_threads, num_replicates);
+  SawBootWorker *workers = g_new0 (SawBootWorker, num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    SawBootWorker *w = &workers[i];
+    w->boot = boot;
+    w->fit_bins = fit_bins;
+    w->seed = seed;
+    w->first = (gint64) num_replicates * i / num_threads;
+    w->last = (gint64) num_replicates * (i + 1) / num_threads;
+    w->r2 = r2;
+    w->nu = nus;
+    w->thread = g_thread_new ("bootstrap", saw_bootstrap_thread, w);
+  }
+  for (int i = 0; i < num_threads; i++) {
+    g_thread_join (workers[i].thread);
+  }
+  g_free (workers);
+
+  /* Output */
+  int status = 0;
+  FILE *fp = fopen (filename, "w");
+  if (fp != NULL) {
+    double lo, hi;
+    status = (fprintf (fp, "# bootstrap: %u tiles, %i replicates, "
+                       "%g%% intervals\n"
+                       "# min_steps, lines, mean_steps, mean_sq_distance, "
+                       "lower, upper\n", boot->tiles->len,
+                       num_replicates, 100 * BOOT_CONFIDENCE) >= 0);
+    for (int b = 0; status && b < BOOT_NUM_BINS; b++) {
+      if (count[b] == 0) continue;
+      saw_bootstrap_interval (&r2[b], num_replicates, BOOT_NUM_BINS,
+                              &lo, &hi);
+      status = (fprintf (fp, "%u, %.0f, %f, %f, %f, %f\n", 1u << b,
+                         count[b], exp (sum_log_n[b] / count[b]),
+                         sum_r2[b] / count[b], lo, hi) >= 0);
+    }
+    saw_bootstrap_interval (nus, num_replicates, 1, &lo, &hi);
+    if (status) {
+      status = (fprintf (fp, "# nu, lower, upper: %f, %f, %f\n",
+                         nu, lo, hi) >= 0);
+    }
+    if (fclose (fp) != 0) status = 0;
+  }
+  if (!status && errno == 0) errno = EIO;
+
+  g_free (r2);
+  g_free (nus);
+  return status;
+}
@@ -0,0 +1,221 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#ifdef HAVE_LIBNUMA
+#  include <numa.h>
+#endif
+
+#include "ridge-saw.h"
+
+/* Placement of large image buffers.
+ *
+ * Image buffers are tens or hundreds of MiB, and are walked both along
+ * rows and down columns, so with ordinary pages a large fraction of
+ * accesses miss the TLB.  Buffers allocated here are backed by
+ * transparent huge pages where possible, or by explicit (hugetlbfs)
+ * huge pages if requested and reserved by the administrator, falling
+ * back to transparent huge pages otherwise.  Image surfaces allocated
+ * by libridgetool can't be mapped specially, but are advised to use
+ * transparent huge pages.
+ *
+ * On machines with more than one NUMA node, each pipeline worker is
+ * bound to a node, and prefers to allocate memory there.  A worker's
+ * buffers are allocated and first touched by the worker, so they end
+ * up on its node, and the ridgetool processes it starts inherit the
+ * binding, so they read the worker's image data locally too. */
+
+#define SAW_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+static SawHugePages buffer_huge_pages = SAW_HUGE_PAGES_THP;
+static gboolean buffer_numa = TRUE;
+
+/* Buffers mapped with explicit huge pages.  These must be unmapped
+ * with their length rounded up to whole huge pages. */
+static GMutex buffer_hugetlb_mutex;
+static GHashTable *buffer_hugetlb = NULL;
+
+static gsize
+saw_buffer_hugetlb_len (gsize size)
+{
+  return ((size + SAW_HUGE_PAGE_SIZE - 1)
+          & ~(gsize) (SAW_HUGE_PAGE_SIZE - 1));
+}
+
+/* Parse a huge page mode name.  Returns 0 if the name is unknown. */
+int
+saw_huge_pages_parse (const char *name, SawHugePages *mode)
+{
+  static const struct {
+    const char *name;
+    SawHugePages mode;
+  } modes[] = {
+    {"off", SAW_HUGE_PAGES_OFF},
+    {"thp", SAW_HUGE_PAGES_THP},
+    {"explicit", SAW_HUGE_PAGES_EXPLICIT},
+  };
+  for (unsigned int i = 0; i < G_N_ELEMENTS (modes); i++) {
+    if (strcmp (name, modes[i].name) != 0) continue;
+    *mode = modes[i].mode;
+    return 1;
+  }
+  return 0;
+}
+
+/* Set the allocation policy.  Must be called before any buffers are
+ * allocated. */
+void
+saw_buffer_set_policy (SawHugePages huge_pages, gboolean numa)
+{
+  buffer_huge_pages = huge_pages;
+  buffer_numa = numa;
+}
+
+/* Advise the kernel to back the whole pages within a buffer with
+ * transparent huge pages, if the policy allows. */
+void
+saw_buffer_advise (gpointer buf, gsize size)
+{
+#ifdef MADV_HUGEPAGE
+  if (buffer_huge_pages == SAW_HUGE_PAGES_OFF) return;
+  if (size < SAW_HUGE_PAGE_SIZE) return;
+
+  guintptr page = sysconf (_SC_PAGESIZE);
+  guintptr start = ((guintptr) buf + page - 1) & ~(page - 1);
+  guintptr end = ((guintptr) buf + size) & ~(page - 1);
+  if (end > start) madvise ((void *) start, end - start, MADV_HUGEPAGE);
+#endif
+}
+
+/* Allocate a buffer of size bytes.  Large buffers are mapped
+ * separately, with huge pages according to the policy.  Free with
+ * saw_buffer_free(), passing the same size. */
+gpointer
+saw_buffer_alloc (gsize size)
+{
+  saw_mem_charge (size);
+  if (buffer_huge_pages == SAW_HUGE_PAGES_OFF || size < SAW_HUGE_PAGE_SIZE) {
+    return g_malloc (size);
+  }
+
+#ifdef MAP_HUGETLB
+  if (buffer_huge_pages == SAW_HUGE_PAGES_EXPLICIT) {
+    void *buf = mmap (NULL, saw_buffer_hugetlb_len (size),
+                      PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buf != MAP_FAILED) {
+      g_mutex_lock (&buffer_hugetlb_mutex);
+      if (buffer_hugetlb == NULL) {
+        buffer_hugetlb = g_hash_table_new (g_direct_hash, g_direct_equal);
+      }
+      g_hash_table_add (buffer_hugetlb, buf);
+      g_mutex_unlock (&buffer_hugetlb_mutex);
+      return buf;
+    }
+  }
+#endif
+
+  void *buf = mmap (NULL, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (buf == MAP_FAILED) {
+    fprintf (stderr, "ERROR: Failed to allocate %" G_GSIZE_FORMAT
+             " bytes: %s\n\n", size, strerror (errno));
+    exit (1);
+  }
+  saw_buffer_advise (buf, size);
+  return buf;
+}
+
+void
+saw_buffer_free (gpointer buf, gsize size)
+{
+  if (buf == NULL) return;
+  saw_mem_credit (size);
+  if (buffer_huge_pages == SAW_HUGE_PAGES_OFF || size < SAW_HUGE_PAGE_SIZE) {
+    g_free (buf);
+    return;
+  }
+
+  gsize len = size;
+  g_mutex_lock (&buffer_hugetlb_mutex);
+  if (buffer_hugetlb != NULL && g_hash_table_remove (buffer_hugetlb, buf)) {
+    len = saw_buffer_hugetlb_len (size);
+  }
+  g_mutex_unlock (&buffer_hugetlb_mutex);
+
+  if (munmap (buf, len) != 0) {
+    fprintf (stderr, "WARNING: Failed to free %" G_GSIZE_FORMAT
+             " bytes: %s\n", len, strerror (errno));
+  }
+}
+
+/* Create an image surface, advised to use huge pages.  Free with
+ * saw_surface_free(). */
+RutSurface *
+saw_surface_new (int rows, int cols)
+{
+  gsize size = (gsize) rows * cols * sizeof (float);
+  RutSurface *img = rut_surface_new (rows, cols);
+  saw_buffer_advise (&RUT_SURFACE_REF (img, 0, 0), size);
+  saw_mem_charge (size);
+  return img;
+}
+
+void
+saw_surface_free (RutSurface *img)
+{
+  if (img == NULL) return;
+  saw_mem_credit ((gsize) img->rows * img->cols * sizeof (float));
+  rut_surface_destroy (img);
+}
+
+/* Bind the calling worker thread, and the memory it allocates, to a
+ * NUMA node.  Workers are spread over the available nodes in turn by
+ * index.  Returns the node, or -1 if the thread wasn't bound. */
+int
+saw_numa_bind_worker (int index)
+{
+#ifdef HAVE_LIBNUMA
+  if (!buffer_numa || numa_available () < 0) return -1;
+
+  struct bitmask *nodes = numa_get_mems_allowed ();
+  int num_nodes = numa_bitmask_weight (nodes);
+  int node = -1;
+  if (num_nodes > 1) {
+    int n = index % num_nodes;
+    for (node = 0; ; node++) {
+      if (numa_bitmask_isbitset (nodes, node) && n-- == 0) break;
+    }
+    if (numa_run_on_node (node) == 0) {
+      numa_set_preferred (node);
+    } else {
+      node = -1;
+    }
+  }
+  numa_bitmask_free (nodes);
+  return node;
+#else
+  return -1;
+#endif
+}
@@ -0,0 +1,406 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include "ridge-saw.h"
+
+/* On-disk cache of ridge detection results.
+ *
+ * Each entry holds the compact line data detected in one image file,
+ * and is named after a 64-bit hash of the file's contents, the
+ * detection scale, and the versions of ridge-saw and of the ridgetool
+ * executable.  The hash is XXH64, which runs at memory bandwidth, so
+ * hashing even a large image is cheap compared to detecting lines in
+ * it.
+ *
+ * The total size of the cache is bounded.  Hits update the entry's
+ * modification time, and when the bound is exceeded the least
+ * recently used entries are removed. */
+
+#define CACHE_MAGIC "RSAWLC1"
+#define CACHE_DEFAULT_SIZE 1024 /* MiB */
+#define CACHE_BLOCK_SIZE (1 << 20)
+
+/* ---------------------------------------------------------------- */
+/* XXH64 */
+
+#define XXH_PRIME1 G_GUINT64_CONSTANT(0x9e3779b185ebca87)
+#define XXH_PRIME2 G_GUINT64_CONSTANT(0xc2b2ae3d27d4eb4f)
+#define XXH_PRIME3 G_GUINT64_CONSTANT(0x165667b19e3779f9)
+#define XXH_PRIME4 G_GUINT64_CONSTANT(0x85ebca77c2b2ae63)
+#define XXH_PRIME5 G_GUINT64_CONSTANT(0x27d4eb2f165667c5)
+
+typedef struct _CacheHash CacheHash;
+
+struct _CacheHash
+{
+  guint64 v[4];
+  guint64 seed;
+  guint64 total;
+  guint8 buf[32];
+  gsize buf_len;
+};
+
+static inline guint64
+xxh_rotl (guint64 x, int r)
+{
+  return (x << r) | (x >> (64 - r));
+}
+
+static inline guint64
+xxh_read64 (const guint8 *p)
+{
+  guint64 v;
+  memcpy (&v, p, sizeof (v));
+  return GUINT64_FROM_LE (v);
+}
+
+static inline guint64
+xxh_round (guint64 acc, guint64 input)
+{
+  acc += input * XXH_PRIME2;
+  return xxh_rotl (acc, 31) * XXH_PRIME1;
+}
+
+static inline guint64
+xxh_merge (guint64 acc, guint64 v)
+{
+  acc ^= xxh_round (0, v);
+  return acc * XXH_PRIME1 + XXH_PRIME4;
+}
+
+static void
+cache_hash_init (CacheHash *h, guint64 seed)
+{
+  memset (h, 0, sizeof (*h));
+  h->seed = seed;
+  h->v[0] = seed + XXH_PRIME1 + XXH_PRIME2;
+  h->v[1] = seed + XXH_PRIME2;
+  h->v[2] = seed;
+  h->v[3] = seed - XXH_PRIME1;
+}
+
+static inline void
+cache_hash_stripe (CacheHash *h, const guint8 *p)
+{
+  for (int i = 0; i < 4; i++) {
+    h->v[i] = xxh_round (h->v[i], xxh_read64 (p + 8*i));
+  }
+}
+
+static void
+cache_hash_update (CacheHash *h, const void *data, gsize len)
+{
+  const guint8 *p = data;
+  h->total += len;
+
+  if (h->buf_len > 0) {
+    gsize n = MIN (len, 32 - h->buf_len);
+    memcpy (h->buf + h->buf_len, p, n);
+    h->buf_len += n;
+    p += n;
+    len -= n;
+    if (h->buf_len < 32) return;
+    cache_hash_stripe (h, h->buf);
+    h->buf_len = 0;
+  }
+  for (; len >= 32; p += 32, len -= 32) {
+    cache_hash_stripe (h, p);
+  }
+  memcpy (h->buf, p, len);
+  h->buf_len = len;
+}
+
+static guint64
+cache_hash_digest (const CacheHash *h)
+{
+  guint64 acc;
+  if (h->total >= 32) {
+    acc = (xxh_rotl (h->v[0], 1) + xxh_rotl (h->v[1], 7)
+           + xxh_rotl (h->v[2], 12) + xxh_rotl (h->v[3], 18));
+    for (int i = 0; i < 4; i++) acc = xxh_merge (acc, h->v[i]);
+  } else {
+    acc = h->seed + XXH_PRIME5;
+  }
+  acc += h->total;
+
+  const guint8 *p = h->buf;
+  gsize len = h->buf_len;
+  for (; len >= 8; p += 8, len -= 8) {
+    acc ^= xxh_round (0, xxh_read64 (p));
+    acc = xxh_rotl (acc, 27) * XXH_PRIME1 + XXH_PRIME4;
+  }
+  if (len >= 4) {
+    guint32 v;
+    memcpy (&v, p, sizeof (v));
+    acc ^= (guint64) GUINT32_FROM_LE (v) * XXH_PRIME1;
+    acc = xxh_rotl (acc, 23) * XXH_PRIME2 + XXH_PRIME3;
+    p += 4;
+    len -= 4;
+  }
+  for (; len > 0; p++, len--) {
+    acc ^= *p * XXH_PRIME5;
+    acc = xxh_rotl (acc, 11) * XXH_PRIME1;
+  }
+
+  acc ^= acc >> 33;
+  acc *= XXH_PRIME2;
+  acc ^= acc >> 29;
+  acc *= XXH_PRIME3;
+  acc ^= acc >> 32;
+  return acc;
+}
+
+/* ---------------------------------------------------------------- */
+/* Cache directory */
+
+static GMutex cache_mutex;
+static gint64 cache_limit = -1; /* Bytes; 0 if disabled */
+static gint64 cache_used = -1;  /* Bytes, or -1 if not yet counted */
+
+/* Get the directory for cached data, creating it if necessary.  The
+ * subdir may be NULL. */
+gchar *
+saw_cache_dir (const char *subdir)
+{
+  gchar *dir = g_build_filename (g_get_user_cache_dir (), "ridge-saw",
+                                 subdir, NULL);
+  g_mkdir_with_parents (dir, 0755);
+  return dir;
+}
+
+static gint64
+cache_get_limit (void)
+{
+  if (cache_limit < 0) {
+    const gchar *env = g_getenv ("RIDGE_SAW_CACHE_SIZE");
+    cache_limit = (gint64) CACHE_DEFAULT_SIZE << 20;
+    if (env != NULL) cache_limit = (gint64) atol (env) << 20;
+    if (cache_limit < 0) cache_limit = 0;
+  }
+  return cache_limit;
+}
+
+/* Whether the detection cache is enabled. */
+int
+saw_cache_enabled (void)
+{
+  g_mutex_lock (&cache_mutex);
+  int enabled = (cache_get_limit () > 0);
+  g_mutex_unlock (&cache_mutex);
+  return enabled;
+}
+
+static gchar *
+cache_entry_filename (guint64 key)
+{
+  gchar *dir = saw_cache_dir ("lines");
+  gchar *name = g_strdup_printf ("%016" G_GINT64_MODIFIER "x.lines", key);
+  gchar *filename = g_build_filename (dir, name, NULL);
+  g_free (dir);
+  g_free (name);
+  return filename;
+}
+
+typedef struct _CacheEntry CacheEntry;
+
+struct _CacheEntry
+{
+  gchar *filename;
+  gint64 size;
+  time_t mtime;
+};
+
+static int
+cache_entry_compare (gconstpointer a, gconstpointer b)
+{
+  const CacheEntry *ea = a, *eb = b;
+  return (ea->mtime > eb->mtime) - (ea->mtime < eb->mtime);
+}
+
+/* Measure the cache, and if it's larger than the limit, remove least
+ * recently used entries until it's at most 3/4 full.  Must be called
+ * with the cache mutex held. */
+static void
+cache_evict (void)
+{
+  gchar *dir = saw_cache_dir ("lines");
+  GDir *d = g_dir_open (dir, 0, NULL);
+  if (d == NULL) {
+    g_free (dir);
+    return;
+  }
+
+  GArray *entries = g_array_new (FALSE, FALSE, sizeof (CacheEntry));
+  const gchar *name;
+  cache_used = 0;
+  while ((name = g_dir_read_name (d)) != NULL) {
+    if (!g_str_has_suffix (name, ".lines")) continue;
+    CacheEntry e;
+    struct stat st;
+    e.filename = g_build_filename (dir, name, NULL);
+    if (stat (e.filename, &st) != 0) {
+      g_free (e.filename);
+      continue;
+    }
+    e.size = st.st_size;
+    e.mtime = st.st_mtime;
+    cache_used += e.size;
+    g_array_append_val (entries, e);
+  }
+  g_dir_close (d);
+  g_free (dir);
+
+  if (cache_used > cache_limit) {
+    g_array_sort (entries, cache_entry_compare);
+    for (guint i = 0; i < entries->len && cache_used > cache_limit / 4 * 3;
+         i++) {
+      CacheEntry *e = &g_array_index (entries, CacheEntry, i);
+      if (unlink (e->filename) == 0) cache_used -= e->size;
+    }
+  }
+
+  for (guint i = 0; i < entries->len; i++) {
+    g_free (g_array_index (entries, CacheEntry, i).filename);
+  }
+  g_array_free (entries, TRUE);
+}
+
+/* ---------------------------------------------------------------- */
+/* Cache entries */
+
+/* Compute the cache key for detecting lines in filename at the given
+ * scale.  Returns 0 on failure (e.g. if the file can't be read). */
+guint64
+saw_cache_key (const char *filename, float scale)
+{
+  /* Identify the version of ridgetool by its size and modification
+   * time. */
+  gchar *path = g_find_program_in_path (get_ridgetool_path ());
+  struct stat st;
+  memset (&st, 0, sizeof (st));
+  if (path != NULL) stat (path, &st);
+
+  gchar *params = g_strdup_printf ("%s %s %s %" G_GINT64_FORMAT
+                                   " %" G_GINT64_FORMAT " %a",
+                                   CACHE_MAGIC, PACKAGE_VERSION,
+                                   path ? path : "",
+                                   (gint64) st.st_size,
+                                   (gint64) st.st_mtime, (double) scale);
+  CacheHash h;
+  cache_hash_init (&h, 0);
+  cache_hash_update (&h, params, strlen (params));
+  guint64 seed = cache_hash_digest (&h);
+  g_free (params);
+  g_free (path);
+
+  FILE *fp = fopen (filename, "rb");
+  if (fp == NULL) return 0;
+
+  guint8 *buf = g_malloc (CACHE_BLOCK_SIZE);
+  size_t n;
+  cache_hash_init (&h, seed);
+  while ((n = fread (buf, 1, CACHE_BLOCK_SIZE, fp)) > 0) {
+    cache_hash_update (&h, buf, n);
+  }
+  int ok = !ferror (fp);
+  fclose (fp);
+  g_free (buf);
+
+  if (!ok) return 0;
+  guint64 key = cache_hash_digest (&h);
+  return (key != 0) ? key : 1;
+}
+
+/* Look up cached line data.  Returns NULL on a cache miss. */
+SawLines *
+saw_cache_lookup (guint64 key)
+{
+  gchar *filename = cache_entry_filename (key);
+  gchar *contents = NULL;
+  gsize len;
+  SawLines *lines = NULL;
+
+  if (!g_file_get_contents (filename, &contents, &len, NULL)) goto done;
+
+  /* Check header */
+  guint32 header[2];
+  gsize header_len = sizeof (CACHE_MAGIC) + sizeof (key) + sizeof (header);
+  if (len < header_len
+      || memcmp (contents, CACHE_MAGIC, sizeof (CACHE_MAGIC)) != 0
+      || memcmp (contents + sizeof (CACHE_MAGIC), &key, sizeof (key)) != 0) {
+    goto done;
+  }
+  memcpy (header, contents + sizeof (CACHE_MAGIC) + sizeof (key),
+          sizeof (header));
+  gsize offsets_len = sizeof (guint32) * ((gsize) header[0] + 1);
+  gsize points_len = sizeof (gint32) * 2 * (gsize) header[1];
+  if (len != header_len + offsets_len + points_len) goto done;
+
+  lines = saw_lines_new (header[0], header[1]);
+  memcpy (lines->offsets, contents + header_len, offsets_len);
+  memcpy (lines->points, contents + header_len + offsets_len, points_len);
+
+  /* Mark as recently used */
+  utime (filename, NULL);
+
+ done:
+  g_free (contents);
+  g_free (filename);
+  return lines;
+}
+
+/* Save line data to the cache. */
+void
+saw_cache_store (guint64 key, const SawLines *lines)
+{
+  guint32 header[2] = {lines->num_lines, lines->num_points};
+  gsize offsets_len = sizeof (guint32) * ((gsize) lines->num_lines + 1);
+  gsize points_len = sizeof (gint32) * 2 * (gsize) lines->num_points;
+
+  GString *str = g_string_sized_new (sizeof (CACHE_MAGIC) + sizeof (key)
+                                     + sizeof (header) + offsets_len
+                                     + points_len);
+  g_string_append_len (str, CACHE_MAGIC, sizeof (CACHE_MAGIC));
+  g_string_append_len (str, (gchar *) &key, sizeof (key));
+  g_string_append_len (str, (gchar *) header, sizeof (header));
+  g_string_append_len (str, (gchar *) lines->offsets, offsets_len);
+  g_string_append_len (str, (gchar *) lines->points, points_len);
+
+  gchar *filename = cache_entry_filename (key);
+  if (g_file_set_contents (filename, str->str, str->len, NULL)) {
+    g_mutex_lock (&cache_mutex);
+    if (cache_used < 0) {
+      cache_evict ();
+    } else {
+      cache_used += str->len;
+      if (cache_used > cache_get_limit ()) cache_evict ();
+    }
+    g_mutex_unlock (&cache_mutex);
+  }
+  g_free (filename);
+  g_string_free (str, TRUE);
+}
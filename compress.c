@@ -0,0 +1,162 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#  include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#  include <zstd.h>
+#endif
+
+#include "ridge-saw.h"
+
+/* Block compression for output.  Each block of output is compressed
+ * independently into a complete gzip member or zstd frame, so blocks
+ * can be compressed in parallel and the results simply concatenated;
+ * both gzip and zstd decompressors accept concatenated members or
+ * frames as a single stream. */
+
+#define SAW_COMPRESS_LEVEL_GZIP 6
+#define SAW_COMPRESS_LEVEL_ZSTD 3
+
+static const struct {
+  const char *name;
+  const char *suffix;
+  SawCompression compression;
+  gboolean available;
+} saw_compressions[] = {
+  {"none", NULL, SAW_COMPRESS_NONE, TRUE},
+#ifdef HAVE_ZLIB
+  {"gzip", ".gz", SAW_COMPRESS_GZIP, TRUE},
+#else
+  {"gzip", ".gz", SAW_COMPRESS_GZIP, FALSE},
+#endif
+#ifdef HAVE_ZSTD
+  {"zstd", ".zst", SAW_COMPRESS_ZSTD, TRUE},
+#else
+  {"zstd", ".zst", SAW_COMPRESS_ZSTD, FALSE},
+#endif
+};
+
+/* Parse a compression format name.  Returns 0 if the name is unknown
+ * or the format isn't available in this build. */
+int
+saw_compression_parse (const char *name, SawCompression *compression)
+{
+  for (unsigned int i = 0; i < G_N_ELEMENTS (saw_compressions); i++) {
+    if (strcmp (name, saw_compressions[i].name) != 0) continue;
+    if (!saw_compressions[i].available) return 0;
+    *compression = saw_compressions[i].compression;
+    return 1;
+  }
+  return 0;
+}
+
+/* Guess the compression format from an output filename's suffix.
+ * Returns 0 if the format isn't available in this build. */
+int
+saw_compression_from_filename (const char *filename,
+                               SawCompression *compression)
+{
+  *compression = SAW_COMPRESS_NONE;
+  for (unsigned int i = 0; i < G_N_ELEMENTS (saw_compressions); i++) {
+    if (saw_compressions[i].suffix == NULL
+        || !g_str_has_suffix (filename, saw_compressions[i].suffix)) {
+      continue;
+    }
+    if (!saw_compressions[i].available) return 0;
+    *compression = saw_compressions[i].compression;
+    return 1;
+  }
+  return 1;
+}
+
+/* Maximum compressed size of a block of len bytes. */
+gsize
+saw_compress_bound (SawCompression compression, gsize len)
+{
+  switch (compression) {
+#ifdef HAVE_ZLIB
+  case SAW_COMPRESS_GZIP:
+    /* deflateBound() plus the gzip header and trailer */
+    return compressBound (len) + 18;
+#endif
+#ifdef HAVE_ZSTD
+  case SAW_COMPRESS_ZSTD:
+    return ZSTD_compressBound (len);
+#endif
+  default:
+    return len;
+  }
+}
+
+#ifdef HAVE_ZLIB
+static gsize
+saw_compress_gzip (const char *src, gsize len, char *dest, gsize dest_len)
+{
+  z_stream z;
+  memset (&z, 0, sizeof (z));
+  /* 16 + MAX_WBITS selects a gzip wrapper */
+  if (deflateInit2 (&z, SAW_COMPRESS_LEVEL_GZIP, Z_DEFLATED, 16 + MAX_WBITS,
+                    8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    return 0;
+  }
+  z.next_in = (Bytef *) src;
+  z.avail_in = len;
+  z.next_out = (Bytef *) dest;
+  z.avail_out = dest_len;
+  int status = deflate (&z, Z_FINISH);
+  gsize out_len = z.total_out;
+  deflateEnd (&z);
+  return (status == Z_STREAM_END) ? out_len : 0;
+}
+#endif
+
+/* Compress a block of len bytes from src into dest, which must have
+ * room for saw_compress_bound() bytes.  Returns the compressed length,
+ * or 0 on failure.  Safe to call from several threads at once. */
+gsize
+saw_compress_block (SawCompression compression, const char *src, gsize len,
+                    char *dest, gsize dest_len)
+{
+  switch (compression) {
+  case SAW_COMPRESS_NONE:
+    if (dest_len < len) return 0;
+    memcpy (dest, src, len);
+    return len;
+#ifdef HAVE_ZLIB
+  case SAW_COMPRESS_GZIP:
+    return saw_compress_gzip (src, len, dest, dest_len);
+#endif
+#ifdef HAVE_ZSTD
+  case SAW_COMPRESS_ZSTD:
+    {
+      size_t n = ZSTD_compress (dest, dest_len, src, len,
+                                SAW_COMPRESS_LEVEL_ZSTD);
+      return ZSTD_isError (n) ? 0 : n;
+    }
+#endif
+  default:
+    g_assert_not_reached ();
+  }
+  return 0;
+}
@@ -0,0 +1,146 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef HAVE_SCHED_GETAFFINITY
+#  include <sched.h>
+#endif
+
+#include "ridge-saw.h"
+
+/* Number of processors ridge-saw may actually use.
+ *
+ * In a container, the processor count reported by the system is
+ * usually the host's.  The processors ridge-saw may run on are limited
+ * by its CPU affinity mask, and the time it may use by any cgroup v2
+ * CPU bandwidth limits ("cpu.max") on its cgroup and the cgroups above
+ * it.  Running more workers than either allows only leads to
+ * oversubscription or throttling. */
+
+#define CPUS_CGROUP_ROOT "/sys/fs/cgroup"
+
+/* Number of processors in the affinity mask, or 0 if unknown. */
+static int
+cpus_affinity (void)
+{
+#ifdef HAVE_SCHED_GETAFFINITY
+  /* Allow for masks bigger than the default cpu_set_t */
+  for (int size = CPU_SETSIZE; size <= 64 * CPU_SETSIZE; size *= 2) {
+    cpu_set_t *set = CPU_ALLOC (size);
+    size_t set_size = CPU_ALLOC_SIZE (size);
+    if (set == NULL) return 0;
+    int status = sched_getaffinity (0, set_size, set);
+    int count = (status == 0) ? CPU_COUNT_S (set_size, set) : 0;
+    CPU_FREE (set);
+    if (status == 0) return count;
+  }
+#endif
+  return 0;
+}
+
+/* Processors allowed by a cgroup's cpu.max file, or 0 if there is no
+ * limit. */
+static double
+cpus_cgroup_max (const char *dir)
+{
+  gchar *filename = g_build_filename (dir, "cpu.max", NULL);
+  gchar *contents = NULL;
+  double cpus = 0;
+  if (g_file_get_contents (filename, &contents, NULL, NULL)) {
+    /* Format is "QUOTA PERIOD", where QUOTA may be "max" */
+    double quota, period;
+    if (sscanf (contents, "%lf %lf", &quota, &period) == 2
+        && quota > 0 && period > 0) {
+      cpus = quota / period;
+    }
+  }
+  g_free (contents);
+  g_free (filename);
+  return cpus;
+}
+
+/* Processors allowed by the CPU bandwidth limits on ridge-saw's
+ * cgroup and its ancestors, or 0 if unlimited or unknown. */
+static double
+cpus_cgroup (void)
+{
+  gchar *contents = NULL;
+  if (!g_file_get_contents ("/proc/self/cgroup", &contents, NULL, NULL)) {
+    return 0;
+  }
+
+  /* The cgroup v2 entry is "0::/PATH" */
+  const char *path = NULL;
+  gchar **lines = g_strsplit (contents, "\n", -1);
+  for (int i = 0; lines[i] != NULL; i++) {
+    if (g_str_has_prefix (lines[i], "0::/")) {
+      path = lines[i] + 3;
+      break;
+    }
+  }
+
+  double cpus = 0;
+  if (path != NULL) {
+    gchar *dir = g_build_filename (CPUS_CGROUP_ROOT, path, NULL);
+    size_t root_len = strlen (CPUS_CGROUP_ROOT);
+    for (;;) {
+      double limit = cpus_cgroup_max (dir);
+      if (limit > 0 && (cpus == 0 || limit < cpus)) cpus = limit;
+
+      /* Move up to the parent, stopping at the root */
+      char *sep = strrchr (dir, '/');
+      if (sep == NULL || (size_t) (sep - dir) < root_len) break;
+      *sep = '\0';
+    }
+    g_free (dir);
+  }
+
+  g_strfreev (lines);
+  g_free (contents);
+  return cpus;
+}
+
+/* Number of processors ridge-saw can use, taking into account its CPU
+ * affinity and any cgroup CPU quota.  Always at least 1. */
+int
+saw_available_cpus (void)
+{
+  int cpus = g_get_num_processors ();
+
+  int affinity = cpus_affinity ();
+  if (affinity > 0) cpus = MIN (cpus, affinity);
+
+  /* A fractional quota still allows part of another processor, so
+   * round up. */
+  double quota = cpus_cgroup ();
+  if (quota > 0) cpus = MIN (cpus, (int) ceil (quota));
+
+  return MAX (cpus, 1);
+}
+
+/* Default number of worker threads, leaving reserve processors free
+ * for the output writer and ridgetool.  Always at least 1. */
+int
+saw_default_threads (int reserve)
+{
+  return MAX (saw_available_cpus () - reserve, 1);
+}
@@ -0,0 +1,323 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ridge-saw.h"
+
+/* Exact enumeration of self-avoiding walks on the square lattice.
+ *
+ * Only walks whose first step is in the +x direction, and whose first
+ * step off the x axis is in the +y direction, are enumerated.  Every
+ * other walk is an image of one of these under a lattice symmetry, so
+ * the straight walk stands for 4 walks and every other walk stands for
+ * 8.
+ *
+ * The main thread enumerates all walks up to ENUM_SPLIT_DEPTH steps,
+ * and saves each one of exactly that length as a prefix.  Worker
+ * threads then take prefixes in turn and extend them to the full
+ * length with a depth-first search.
+ *
+ * Counts and sums of squared end-to-end distance are exact, and are
+ * cached on disk, so the enumeration only has to be run once for each
+ * length. */
+
+#define ENUM_SPLIT_DEPTH 12
+#define ENUM_CACHE_NAME "enum-square.csv"
+
+static const int enum_steps[4][2] = { {1, 0}, {0, 1}, {-1, 0}, {0, -1} };
+
+typedef struct _EnumJob EnumJob;
+typedef struct _EnumWorker EnumWorker;
+
+struct _EnumJob
+{
+  int length;
+  int split;
+  GArray *prefixes;    /* Steps of each prefix, split bytes each */
+  volatile gint next_prefix;
+};
+
+struct _EnumWorker
+{
+  EnumJob *job;
+  GThread *thread;
+
+  int stride;      /* Row length of grid */
+  guint8 *grid;    /* Occupied sites, with the origin at the centre */
+  guint8 *steps;   /* Step directions of current walk */
+  guint64 *count;  /* Number of walks, per length */
+  guint64 *sum_r2; /* Sum of squared end-to-end distance, per length */
+};
+
+static EnumWorker *
+enum_worker_new (EnumJob *job)
+{
+  EnumWorker *w = g_new0 (EnumWorker, 1);
+  w->job = job;
+  w->stride = 2 * job->length + 3;
+  w->grid = g_new0 (guint8, w->stride * w->stride);
+  w->steps = g_new0 (guint8, job->length + 1);
+  w->count = g_new0 (guint64, job->length + 1);
+  w->sum_r2 = g_new0 (guint64, job->length + 1);
+  return w;
+}
+
+static void
+enum_worker_free (EnumWorker *w)
+{
+  if (w == NULL) return;
+  g_free (w->grid);
+  g_free (w->steps);
+  g_free (w->count);
+  g_free (w->sum_r2);
+  g_free (w);
+}
+
+static void enum_extend (EnumWorker *w, int n, int x, int y, int turned,
+                         int depth);
+
+/* Depth-first search from a walk of n steps ending at (x, y).  If
+ * depth is non-zero, walks of that length are saved as prefixes
+ * instead of being extended. */
+static void
+enum_search (EnumWorker *w, int n, int x, int y, int turned, int depth)
+{
+  guint64 mult = turned ? 8 : 4;
+  w->count[n] += mult;
+  w->sum_r2[n] += mult * (guint64) (x*x + y*y);
+
+  if (n == w->job->length) return;
+  if (n == depth) {
+    g_array_append_vals (w->job->prefixes, w->steps, depth);
+    return;
+  }
+  enum_extend (w, n, x, y, turned, depth);
+}
+
+/* Search all single-step extensions of a walk of n steps. */
+static void
+enum_extend (EnumWorker *w, int n, int x, int y, int turned, int depth)
+{
+  for (int i = 0; i < 4; i++) {
+    /* Before the first turn, only +x and +y are allowed. */
+    if (!turned && i > 1) break;
+
+    int nx = x + enum_steps[i][0];
+    int ny = y + enum_steps[i][1];
+    guint8 *site = &w->grid[(ny + w->job->length + 1) * w->stride
+                            + nx + w->job->length + 1];
+    if (*site) continue;
+
+    *site = 1;
+    w->steps[n] = i;
+    enum_search (w, n + 1, nx, ny, turned || (i != 0), depth);
+    *site = 0;
+  }
+}
+
+/* Replay a prefix onto the worker's grid and extend it. */
+static void
+enum_search_prefix (EnumWorker *w, const guint8 *prefix)
+{
+  int split = w->job->split;
+  int offset = w->job->length + 1;
+  int x = 0, y = 0, turned = 0;
+
+  w->grid[offset * w->stride + offset] = 1;
+  for (int i = 0; i < split; i++) {
+    x += enum_steps[prefix[i]][0];
+    y += enum_steps[prefix[i]][1];
+    turned = turned || (prefix[i] != 0);
+    w->grid[(y + offset) * w->stride + x + offset] = 1;
+  }
+
+  /* The prefix itself was already counted by the main thread. */
+  enum_extend (w, split, x, y, turned, 0);
+
+  memset (w->grid, 0, w->stride * w->stride);
+}
+
+static gpointer
+enum_worker_thread (gpointer user_data)
+{
+  EnumWorker *w = (EnumWorker *) user_data;
+  EnumJob *job = w->job;
+  int num_prefixes = job->prefixes->len / job->split;
+
+  while (!saw_shutdown_requested ()) {
+    int i = g_atomic_int_add (&job->next_prefix, 1);
+    if (i >= num_prefixes) break;
+    enum_search_prefix (w, (guint8 *) job->prefixes->data + i * job->split);
+  }
+  return NULL;
+}
+
+/* Enumerate all walks of up to length steps, using num_threads
+ * threads.  Results are added to the count and sum_r2 arrays, which
+ * must have length + 1 entries.  Returns the longest step count for
+ * which results are complete, which is less than length if
+ * enumeration was interrupted. */
+static int
+enum_run (int length, int num_threads, guint64 *count, guint64 *sum_r2)
+{
+  EnumJob job = {length, MIN (length, ENUM_SPLIT_DEPTH), NULL, 0};
+  job.prefixes = g_array_new (FALSE, FALSE, 1);
+
+  /* Walks up to the split depth, and the prefixes. */
+  EnumWorker *main_worker = enum_worker_new (&job);
+  int offset = length + 1;
+  main_worker->grid[offset * main_worker->stride + offset] = 1;
+  main_worker->steps[0] = 0;
+  main_worker->grid[offset * main_worker->stride + offset + 1] = 1;
+  enum_search (main_worker, 1, 1, 0, 0, job.split);
+
+  EnumWorker **workers = g_new0 (EnumWorker *, num_threads);
+  if (job.split < length) {
+    for (int i = 0; i < num_threads; i++) {
+      workers[i] = enum_worker_new (&job);
+      workers[i]->thread = g_thread_new ("enumerate", enum_worker_thread,
+                                         workers[i]);
+    }
+  }
+
+  for (int n = 0; n <= length; n++) {
+    count[n] += main_worker->count[n];
+    sum_r2[n] += main_worker->sum_r2[n];
+  }
+  enum_worker_free (main_worker);
+
+  for (int i = 0; i < num_threads; i++) {
+    if (workers[i] == NULL) continue;
+    g_thread_join (workers[i]->thread);
+    for (int n = 0; n <= length; n++) {
+      count[n] += workers[i]->count[n];
+      sum_r2[n] += workers[i]->sum_r2[n];
+    }
+    enum_worker_free (workers[i]);
+  }
+  g_free (workers);
+  g_array_free (job.prefixes, TRUE);
+
+  /* Walks up to the split depth are all counted by the main thread */
+  return saw_shutdown_requested () ? job.split : length;
+}
+
+/* ---------------------------------------------------------------- */
+/* Cache */
+
+static gchar *
+enum_cache_filename (void)
+{
+  gchar *dir = saw_cache_dir (NULL);
+  gchar *filename = g_build_filename (dir, ENUM_CACHE_NAME, NULL);
+  g_free (dir);
+  return filename;
+}
+
+/* Load as much of the enumeration as is cached, up to length steps.
+ * Returns the longest length loaded, or 0 if there is no cache. */
+static int
+enum_cache_load (int length, guint64 *count, guint64 *sum_r2)
+{
+  gchar *filename = enum_cache_filename ();
+  FILE *fp = fopen (filename, "r");
+  g_free (filename);
+  if (fp == NULL) return 0;
+
+  char buf[256];
+  int max = 0;
+  while (fgets (buf, sizeof (buf), fp) != NULL) {
+    int n;
+    guint64 c, r2;
+    if (buf[0] == '#') continue;
+    if (sscanf (buf, "%i, %" G_GUINT64_FORMAT ", %" G_GUINT64_FORMAT,
+                &n, &c, &r2) != 3) {
+      max = 0; /* Corrupt; ignore cache */
+      break;
+    }
+    if (n != max + 1) break;
+    if (n > length) break;
+    count[n] = c;
+    sum_r2[n] = r2;
+    max = n;
+  }
+  fclose (fp);
+  return max;
+}
+
+static void
+enum_cache_save (int length, const guint64 *count, const guint64 *sum_r2)
+{
+  GString *str = g_string_new ("# ridge-saw exact enumeration, square "
+                               "lattice: num_steps, count, sum_sq_distance\n");
+  for (int n = 1; n <= length; n++) {
+    g_string_append_printf (str, "%i, %" G_GUINT64_FORMAT
+                            ", %" G_GUINT64_FORMAT "\n",
+                            n, count[n], sum_r2[n]);
+  }
+
+  gchar *filename = enum_cache_filename ();
+  GError *err = NULL;
+  if (!g_file_set_contents (filename, str->str, str->len, &err)) {
+    fprintf (stderr, "WARNING: Failed to save enumeration cache '%s': %s\n",
+             filename, err->message);
+    g_error_free (err);
+  }
+  g_free (filename);
+  g_string_free (str, TRUE);
+}
+
+/* Exactly enumerate walks of up to length steps, using num_threads
+ * threads, and add their counts and mean square end-to-end distances
+ * to the output as aggregate statistics. */
+void
+enum_generate (int length, int num_threads, SawOutput *out)
+{
+  g_assert (length > 0 && length <= ENUM_MAX_LENGTH);
+  g_assert (num_threads > 0);
+  g_assert (out);
+
+  guint64 *count = g_new0 (guint64, length + 1);
+  guint64 *sum_r2 = g_new0 (guint64, length + 1);
+
+  int complete = length;
+  if (enum_cache_load (length, count, sum_r2) < length) {
+    memset (count, 0, sizeof (guint64) * (length + 1));
+    memset (sum_r2, 0, sizeof (guint64) * (length + 1));
+    complete = enum_run (length, num_threads, count, sum_r2);
+    if (complete == length) enum_cache_save (length, count, sum_r2);
+  }
+
+  /* The set of all walks is symmetric under reflection in the
+   * axes and diagonals, so the mean square displacement is shared
+   * equally between the components, which are uncorrelated. */
+  SawStats *stats = saw_stats_new ();
+  for (int n = 1; n <= complete; n++) {
+    saw_stats_add_sums (stats, n, count[n], 0.5 * sum_r2[n],
+                        0.5 * sum_r2[n], 0);
+  }
+  saw_output_merge_stats (out, stats);
+  saw_stats_free (stats);
+
+  g_free (count);
+  g_free (sum_r2);
+}
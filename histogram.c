@@ -0,0 +1,182 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ridge-saw.h"
+
+/* Two-dimensional histogram of step count N and scaled end-to-end
+ * distance R / N^nu.
+ *
+ * Rows are quarter-octave bins of N: row 4k + j holds step counts from
+ * 2^k (1 + j/4) up to the start of the next row, so that the bin edges
+ * are exact integers.  Columns are bins of R / N^nu of equal width, up
+ * to HIST_X_MAX, and a final column counts everything beyond that.
+ * With nu close to its true value, each row is then an estimate of
+ * the same scaling function, whatever N.
+ *
+ * Records arrive from many threads at once, so each thread adds to
+ * its own copy of the histogram, found through a GPrivate, and the
+ * copies are only added up when the histogram is written out.  The
+ * memory used is fixed, however many records there are. */
+
+#define HIST_NUM_ROWS (32 * 4)
+#define HIST_NUM_COLS 80       /* Not including the overflow column */
+#define HIST_X_MAX 4.0
+#define HIST_STRIDE (HIST_NUM_COLS + 3) /* weight, sum_n, columns */
+
+typedef struct _SawHistogramLocal SawHistogramLocal;
+
+struct _SawHistogramLocal
+{
+  SawHistogram *hist;
+  double *bins;  /* HIST_STRIDE values per row */
+};
+
+struct _SawHistogram
+{
+  double nu;
+  GPtrArray *locals;
+  GMutex mutex;
+};
+
+static GPrivate histogram_local = G_PRIVATE_INIT (NULL);
+
+SawHistogram *
+saw_histogram_new (double nu)
+{
+  g_assert (nu > 0);
+  SawHistogram *hist = g_new0 (SawHistogram, 1);
+  hist->nu = nu;
+  hist->locals = g_ptr_array_new ();
+  g_mutex_init (&hist->mutex);
+  return hist;
+}
+
+/* Free a histogram.  Any threads that added to it must have
+ * finished. */
+void
+saw_histogram_free (SawHistogram *hist)
+{
+  if (hist == NULL) return;
+  for (guint i = 0; i < hist->locals->len; i++) {
+    SawHistogramLocal *local = g_ptr_array_index (hist->locals, i);
+    saw_mem_credit (HIST_NUM_ROWS * HIST_STRIDE * sizeof (double));
+    g_free (local->bins);
+    g_free (local);
+  }
+  g_ptr_array_free (hist->locals, TRUE);
+  g_mutex_clear (&hist->mutex);
+  g_free (hist);
+  g_private_set (&histogram_local, NULL);
+}
+
+/* Row for a step count of at least 1. */
+static int
+saw_histogram_row (guint num_steps)
+{
+  int k = g_bit_storage (num_steps) - 1;
+  guint j = ((k >= 2) ? (num_steps >> (k - 2)) : (num_steps << (2 - k))) & 3;
+  return 4 * k + j;
+}
+
+/* Smallest step count in a row. */
+static guint64
+saw_histogram_row_min (int row)
+{
+  guint64 m = (guint64) (4 + row % 4) << (row / 4);
+  return (m + 3) / 4;
+}
+
+/* Add a record with num_steps steps and end-to-end displacement (dx,
+ * dy).  Records of no steps are ignored.  Safe to call from several
+ * threads at once. */
+void
+saw_histogram_add (SawHistogram *hist, int num_steps, double dx, double dy,
+                   double weight)
+{
+  if (num_steps <= 0) return;
+
+  SawHistogramLocal *local = g_private_get (&histogram_local);
+  if (local == NULL || local->hist != hist) {
+    local = g_new0 (SawHistogramLocal, 1);
+    local->hist = hist;
+    local->bins = g_new0 (double, HIST_NUM_ROWS * HIST_STRIDE);
+    saw_mem_charge (HIST_NUM_ROWS * HIST_STRIDE * sizeof (double));
+    g_mutex_lock (&hist->mutex);
+    g_ptr_array_add (hist->locals, local);
+    g_mutex_unlock (&hist->mutex);
+    g_private_set (&histogram_local, local);
+  }
+
+  double x = sqrt (dx*dx + dy*dy) / pow (num_steps, hist->nu);
+  int col = ((x < HIST_X_MAX) ? (int) (x * HIST_NUM_COLS / HIST_X_MAX)
+             : HIST_NUM_COLS);
+  double *row = &local->bins[saw_histogram_row (num_steps) * HIST_STRIDE];
+  row[0] += weight;
+  row[1] += weight * num_steps;
+  row[2 + col] += weight;
+}
+
+/* Add up the threads' histograms and write the result to a CSV file,
+ * one row per step count bin with any records, in the format
+ * "min_steps, mean_steps, weight, count...", where the counts are the
+ * total weight in each column.  Must only be called once all threads
+ * adding to the histogram have finished.  Returns 0 and sets errno on
+ * failure. */
+int
+saw_histogram_write (SawHistogram *hist, const char *filename)
+{
+  double *bins = g_new0 (double, HIST_NUM_ROWS * HIST_STRIDE);
+  for (guint i = 0; i < hist->locals->len; i++) {
+    const SawHistogramLocal *local = g_ptr_array_index (hist->locals, i);
+    for (int k = 0; k < HIST_NUM_ROWS * HIST_STRIDE; k++) {
+      bins[k] += local->bins[k];
+    }
+  }
+
+  int status = 0;
+  FILE *fp = fopen (filename, "w");
+  if (fp != NULL) {
+    status = (fprintf (fp, "# histogram: nu = %g, %i columns of R/N^nu "
+                       "from 0 to %g, then over %g\n"
+                       "# min_steps, mean_steps, weight, count...\n",
+                       hist->nu, HIST_NUM_COLS, HIST_X_MAX,
+                       HIST_X_MAX) >= 0);
+    for (int r = 0; status && r < HIST_NUM_ROWS; r++) {
+      const double *row = &bins[r * HIST_STRIDE];
+      if (row[0] <= 0) continue;
+      status = (fprintf (fp, "%" G_GUINT64_FORMAT ", %f, %.15g",
+                         saw_histogram_row_min (r), row[1] / row[0],
+                         row[0]) >= 0);
+      for (int c = 0; status && c <= HIST_NUM_COLS; c++) {
+        status = (fprintf (fp, ", %.15g", row[2 + c]) >= 0);
+      }
+      if (status) status = (fputc ('\n', fp) != EOF);
+    }
+    if (fclose (fp) != 0) status = 0;
+  }
+  if (!status && errno == 0) errno = EIO;
+
+  g_free (bins);
+  return status;
+}
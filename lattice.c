@@ -0,0 +1,121 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ridge-saw.h"
+
+/* The table is a power of two in size and is kept at most half full,
+ * so linear probing stays short.  Deletion uses backward shifting
+ * rather than tombstones, because the pivot algorithm deletes and
+ * reinserts large parts of the walk on every accepted move. */
+
+static inline guint64
+site_key (gint32 x, gint32 y)
+{
+  return ((guint64) (guint32) x << 32) | (guint32) y;
+}
+
+static inline guint
+site_slot (const SawSiteHash *hash, guint64 key)
+{
+  /* Fibonacci hashing */
+  return (guint) ((key * G_GUINT64_CONSTANT(0x9e3779b97f4a7c15))
+                  >> hash->shift);
+}
+
+SawSiteHash *
+saw_site_hash_new (guint max_entries)
+{
+  guint bits = 4;
+  while ((G_GUINT64_CONSTANT(1) << bits) < 2 * (guint64) max_entries) bits++;
+
+  SawSiteHash *hash = g_new0 (SawSiteHash, 1);
+  hash->mask = (1u << bits) - 1;
+  hash->shift = 64 - bits;
+  hash->keys = g_new (guint64, hash->mask + 1);
+  hash->values = g_new (gint32, hash->mask + 1);
+  saw_site_hash_clear (hash);
+  return hash;
+}
+
+void
+saw_site_hash_free (SawSiteHash *hash)
+{
+  if (hash == NULL) return;
+  g_free (hash->keys);
+  g_free (hash->values);
+  g_free (hash);
+}
+
+void
+saw_site_hash_clear (SawSiteHash *hash)
+{
+  memset (hash->values, 0xff, sizeof (gint32) * (hash->mask + 1));
+}
+
+gint32
+saw_site_hash_lookup (const SawSiteHash *hash, gint32 x, gint32 y)
+{
+  guint64 key = site_key (x, y);
+  for (guint i = site_slot (hash, key); ; i = (i + 1) & hash->mask) {
+    if (hash->values[i] < 0) return -1;
+    if (hash->keys[i] == key) return hash->values[i];
+  }
+}
+
+void
+saw_site_hash_insert (SawSiteHash *hash, gint32 x, gint32 y, gint32 index)
+{
+  guint64 key = site_key (x, y);
+  guint i = site_slot (hash, key);
+  while (hash->values[i] >= 0 && hash->keys[i] != key) {
+    i = (i + 1) & hash->mask;
+  }
+  hash->keys[i] = key;
+  hash->values[i] = index;
+}
+
+void
+saw_site_hash_remove (SawSiteHash *hash, gint32 x, gint32 y)
+{
+  guint64 key = site_key (x, y);
+  guint i = site_slot (hash, key);
+  while (hash->keys[i] != key || hash->values[i] < 0) {
+    if (hash->values[i] < 0) return; /* Not present */
+    i = (i + 1) & hash->mask;
+  }
+
+  /* Shift back any following entries whose probe sequence passes
+   * through the slot being emptied. */
+  guint j = i;
+  for (;;) {
+    j = (j + 1) & hash->mask;
+    if (hash->values[j] < 0) break;
+    guint home = site_slot (hash, hash->keys[j]);
+    if (((j - home) & hash->mask) >= ((j - i) & hash->mask)) {
+      hash->keys[i] = hash->keys[j];
+      hash->values[i] = hash->values[j];
+      i = j;
+    }
+  }
+  hash->values[i] = -1;
+}
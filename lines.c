@@ -0,0 +1,86 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <math.h>
+
+#include "ridge-saw.h"
+
+/* Compact line data.  Only the pixel containing each line point is
+ * needed for walk statistics, so points are stored as integer (row,
+ * col) pairs, and all lines share a single point array. */
+
+SawLines *
+saw_lines_new (guint num_lines, guint num_points)
+{
+  SawLines *lines = g_new0 (SawLines, 1);
+  lines->num_lines = num_lines;
+  lines->num_points = num_points;
+  lines->offsets = g_new0 (guint32, num_lines + 1);
+  lines->points = g_new (gint32, 2 * (gsize) num_points);
+  saw_mem_charge_lines (saw_lines_size (lines));
+  return lines;
+}
+
+void
+saw_lines_free (SawLines *lines)
+{
+  if (lines == NULL) return;
+  saw_mem_credit (saw_lines_size (lines));
+  g_free (lines->offsets);
+  g_free (lines->points);
+  g_free (lines);
+}
+
+/* Memory used by line data, in bytes. */
+gsize
+saw_lines_size (const SawLines *lines)
+{
+  return (sizeof (SawLines) + (lines->num_lines + 1) * sizeof (guint32)
+          + 2 * (gsize) lines->num_points * sizeof (gint32));
+}
+
+SawLines *
+saw_lines_from_rio_data (RioData *data)
+{
+  g_assert (data);
+  g_assert (rio_data_get_type (data) == RIO_DATA_LINES);
+
+  int num_lines = rio_data_get_num_entries (data);
+  guint num_points = 0;
+  for (int i = 0; i < num_lines; i++) {
+    num_points += rio_line_get_length (rio_data_get_line (data, i));
+  }
+
+  SawLines *lines = saw_lines_new (num_lines, num_points);
+  guint k = 0;
+  for (int i = 0; i < num_lines; i++) {
+    RioLine *l = rio_data_get_line (data, i);
+    int len = rio_line_get_length (l);
+    lines->offsets[i] = k;
+    for (int j = 0; j < len; j++, k++) {
+      double row, col;
+      rio_point_get_subpixel (rio_line_get_point (l, j), &row, &col);
+      lines->points[2*k] = (gint32) floor (row);
+      lines->points[2*k + 1] = (gint32) floor (col);
+    }
+  }
+  lines->offsets[num_lines] = k;
+  return lines;
+}
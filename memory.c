@@ -0,0 +1,210 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ridge-saw.h"
+
+/* Memory budget.
+ *
+ * The large allocations made by ridge-saw -- image buffers and
+ * surfaces, line data and output buffers -- are charged to a global
+ * account as they are made, and credited when they are freed.  If a
+ * limit is set, workers ask for room for a tile's working set before
+ * starting it, and wait while the account plus the room already
+ * promised to tiles in progress would exceed the limit.  A tile is
+ * always allowed to start if no others are in progress, so a limit
+ * that is too small slows processing down to one tile at a time
+ * rather than stopping it. */
+
+static GMutex mem_mutex;
+static GCond mem_cond;
+static guint64 mem_limit = 0;    /* 0 for no limit */
+static guint64 mem_used = 0;
+static guint64 mem_peak = 0;
+static guint64 mem_promised = 0; /* Room promised to tiles in progress */
+static gsize mem_max_lines = 0;  /* Largest set of lines so far */
+static int mem_num_tiles = 0;
+static gint64 mem_throttle_time = 0;
+
+/* Parse a memory size: a number of MiB, or a number followed by one
+ * of the suffixes K, M, G or T.  Returns 0 on failure. */
+int
+saw_mem_parse (const char *str, guint64 *size)
+{
+  char *end;
+  double value = g_ascii_strtod (str, &end);
+  if (end == str || value < 0) return 0;
+
+  int shift;
+  switch (g_ascii_toupper (*end)) {
+  case 'K': shift = 10; break;
+  case '\0':
+  case 'M': shift = 20; break;
+  case 'G': shift = 30; break;
+  case 'T': shift = 40; break;
+  default: return 0;
+  }
+  if (*end != '\0' && end[1] != '\0' && strcmp (end + 1, "iB") != 0
+      && strcmp (end + 1, "B") != 0) {
+    return 0;
+  }
+  *size = (guint64) (value * (double) ((guint64) 1 << shift));
+  return 1;
+}
+
+/* Set the memory limit in bytes, or 0 for no limit. */
+void
+saw_mem_set_limit (guint64 limit)
+{
+  g_mutex_lock (&mem_mutex);
+  mem_limit = limit;
+  g_mutex_unlock (&mem_mutex);
+}
+
+guint64
+saw_mem_get_used (void)
+{
+  g_mutex_lock (&mem_mutex);
+  guint64 used = mem_used;
+  g_mutex_unlock (&mem_mutex);
+  return used;
+}
+
+/* Whether size more bytes would fit within the limit. */
+gboolean
+saw_mem_fits (guint64 size)
+{
+  g_mutex_lock (&mem_mutex);
+  gboolean fits = (mem_limit == 0
+                   || mem_used + mem_promised + size <= mem_limit);
+  g_mutex_unlock (&mem_mutex);
+  return fits;
+}
+
+/* Record an allocation of size bytes. */
+void
+saw_mem_charge (gsize size)
+{
+  g_mutex_lock (&mem_mutex);
+  mem_used += size;
+  mem_peak = MAX (mem_peak, mem_used);
+  g_mutex_unlock (&mem_mutex);
+}
+
+/* Record an allocation of size bytes of line data.  The largest set
+ * of lines so far is used to estimate how much a tile will need. */
+void
+saw_mem_charge_lines (gsize size)
+{
+  g_mutex_lock (&mem_mutex);
+  mem_max_lines = MAX (mem_max_lines, size);
+  g_mutex_unlock (&mem_mutex);
+  saw_mem_charge (size);
+}
+
+/* Record that size bytes have been freed. */
+void
+saw_mem_credit (gsize size)
+{
+  g_mutex_lock (&mem_mutex);
+  g_assert (mem_used >= size);
+  mem_used -= size;
+  g_cond_broadcast (&mem_cond);
+  g_mutex_unlock (&mem_mutex);
+}
+
+/* Wait for room for a tile that will allocate image_size bytes of
+ * image data, plus its lines, and promise the room to the tile.
+ * Returns the room promised, which must be passed to
+ * saw_mem_end_tile() when the tile is finished. */
+gsize
+saw_mem_begin_tile (gsize image_size)
+{
+  g_mutex_lock (&mem_mutex);
+  gsize size = image_size + mem_max_lines;
+  if (mem_limit > 0 && mem_num_tiles > 0
+      && mem_used + mem_promised + size > mem_limit) {
+    gint64 start = g_get_monotonic_time ();
+    while (mem_num_tiles > 0
+           && mem_used + mem_promised + size > mem_limit) {
+      g_cond_wait (&mem_cond, &mem_mutex);
+    }
+    mem_throttle_time += g_get_monotonic_time () - start;
+  }
+  mem_promised += size;
+  mem_num_tiles++;
+  g_mutex_unlock (&mem_mutex);
+  return size;
+}
+
+void
+saw_mem_end_tile (gsize size)
+{
+  g_mutex_lock (&mem_mutex);
+  mem_promised -= size;
+  mem_num_tiles--;
+  g_cond_broadcast (&mem_cond);
+  g_mutex_unlock (&mem_mutex);
+}
+
+/* Peak resident set size of this process, in bytes, from the VmHWM
+ * line of /proc/self/status; or 0 if unavailable. */
+static guint64
+saw_mem_peak_rss (void)
+{
+  gchar *contents = NULL;
+  guint64 kib = 0;
+  if (g_file_get_contents ("/proc/self/status", &contents, NULL, NULL)) {
+    const char *line = strstr (contents, "VmHWM:");
+    if (line != NULL) {
+      sscanf (line + 6, "%" G_GUINT64_FORMAT, &kib);
+    }
+  }
+  g_free (contents);
+  return kib << 10;
+}
+
+/* Print the peak accounted memory use alongside the actual peak RSS
+ * of ridge-saw and of the largest ridgetool child. */
+void
+saw_mem_report (FILE *fp)
+{
+  struct rusage usage;
+  guint64 child_rss = 0;
+  if (getrusage (RUSAGE_CHILDREN, &usage) == 0) {
+    child_rss = (guint64) usage.ru_maxrss << 10;
+  }
+
+  g_mutex_lock (&mem_mutex);
+  fprintf (fp, "Memory: peak %.1f MiB accounted", mem_peak / 1048576.0);
+  if (mem_limit > 0) {
+    fprintf (fp, " of %.1f MiB limit", mem_limit / 1048576.0);
+  }
+  fprintf (fp, ", peak RSS %.1f MiB, largest ridgetool RSS %.1f MiB\n",
+           saw_mem_peak_rss () / 1048576.0, child_rss / 1048576.0);
+  if (mem_throttle_time > 0) {
+    fprintf (fp, "Tiles throttled for %.3f s by memory limit\n",
+             mem_throttle_time / 1e6);
+  }
+  g_mutex_unlock (&mem_mutex);
+}
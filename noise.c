@@ -0,0 +1,637 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <gsl/gsl_randist.h>
+#include <gsl/gsl_fft_real.h>
+#include <gsl/gsl_fft_halfcomplex.h>
+#include <gsl/gsl_fft_complex.h>
+
+#include "ridge-saw.h"
+
+/* ---------------------------------------------------------------- */
+/* Spatially correlated noise */
+
+/* Correlated Gaussian noise is generated by filtering white noise in
+ * the frequency domain with the square root of the desired power
+ * spectrum.
+ *
+ * The 2D transform is done as real-to-halfcomplex transforms of each
+ * row, followed by complex transforms of the cols/2 + 1 non-redundant
+ * columns.  The wavetables, workspaces, spectrum buffer and filter
+ * are all allocated once, and reused for every image of the same
+ * size.  The field is periodic at the image edges. */
+
+struct _CorrNoise
+{
+  int rows, cols;
+  int spec_cols;          /* Number of non-redundant columns */
+  double *row;            /* Halfcomplex row buffer */
+  double *spec;           /* Complex spectrum, spec_cols per row */
+  double *filter;         /* Filter amplitude, spec_cols per row */
+
+  gsl_fft_real_wavetable *row_wt;
+  gsl_fft_halfcomplex_wavetable *row_hwt;
+  gsl_fft_real_workspace *row_ws;
+  gsl_fft_complex_wavetable *col_wt;
+  gsl_fft_complex_workspace *col_ws;
+};
+
+/* Parse a spectrum in the format "gauss:L", "exp:L" or "power:BETA".
+ * Returns 0 on failure. */
+int
+corr_spectrum_parse (const char *str, CorrSpectrum *spectrum)
+{
+  static const struct {
+    const char *name;
+    CorrSpectrumType type;
+  } types[] = {
+    {"gauss", CORR_SPECTRUM_GAUSS},
+    {"exp", CORR_SPECTRUM_EXP},
+    {"power", CORR_SPECTRUM_POWER},
+  };
+
+  const char *sep = strchr (str, ':');
+  if (sep == NULL) return 0;
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS (types); i++) {
+    if (strlen (types[i].name) != (size_t) (sep - str)
+        || strncmp (str, types[i].name, sep - str) != 0) {
+      continue;
+    }
+    char *end;
+    double param = strtod (sep + 1, &end);
+    if (end == sep + 1 || *end != '\0' || !(param > 0)) return 0;
+    spectrum->type = types[i].type;
+    spectrum->param = param;
+    return 1;
+  }
+  return 0;
+}
+
+/* Filter amplitude at angular spatial frequency k (radians per
+ * pixel). */
+static double
+corr_filter_amplitude (const CorrSpectrum *spectrum, double k)
+{
+  double kl = k * spectrum->param;
+  switch (spectrum->type) {
+  case CORR_SPECTRUM_GAUSS:
+    /* Correlation exp(-r^2/L^2) */
+    return exp (-kl*kl / 8);
+  case CORR_SPECTRUM_EXP:
+    /* Correlation exp(-r/L) */
+    return pow (1 + kl*kl, -0.75);
+  case CORR_SPECTRUM_POWER:
+    /* Power spectrum k^-BETA, with no DC component */
+    return (k > 0) ? pow (k, -spectrum->param / 2) : 0;
+  default:
+    g_assert_not_reached ();
+  }
+  return 0;
+}
+
+CorrNoise *
+corr_noise_new (int rows, int cols, const CorrSpectrum *spectrum)
+{
+  g_assert (rows > 0 && cols > 0);
+
+  CorrNoise *cn = g_new0 (CorrNoise, 1);
+  cn->rows = rows;
+  cn->cols = cols;
+  cn->spec_cols = cols / 2 + 1;
+  cn->row = g_new (double, cols);
+  cn->spec = saw_buffer_alloc (2 * sizeof (double) * rows * cn->spec_cols);
+  cn->filter = saw_buffer_alloc (sizeof (double) * rows * cn->spec_cols);
+
+  cn->row_wt = gsl_fft_real_wavetable_alloc (cols);
+  cn->row_hwt = gsl_fft_halfcomplex_wavetable_alloc (cols);
+  cn->row_ws = gsl_fft_real_workspace_alloc (cols);
+  cn->col_wt = gsl_fft_complex_wavetable_alloc (rows);
+  cn->col_ws = gsl_fft_complex_workspace_alloc (rows);
+
+  /* Compute the filter, normalised so that the output has unit
+   * variance.  Every column but the first and (for even widths) the
+   * last stands for itself and its mirror image. */
+  double sum_sq = 0;
+  for (int i = 0; i < rows; i++) {
+    double fr = (double) ((i <= rows / 2) ? i : i - rows) / rows;
+    for (int j = 0; j < cn->spec_cols; j++) {
+      double fc = (double) j / cols;
+      double k = 2 * M_PI * sqrt (fr*fr + fc*fc);
+      double h = corr_filter_amplitude (spectrum, k);
+      int mult = (j == 0 || 2*j == cols) ? 1 : 2;
+      cn->filter[i * cn->spec_cols + j] = h;
+      sum_sq += mult * h * h;
+    }
+  }
+  double mean_sq = sum_sq / ((double) rows * cols);
+  double norm = (mean_sq > 0) ? 1 / sqrt (mean_sq) : 0;
+  for (int i = 0; i < rows * cn->spec_cols; i++) {
+    cn->filter[i] *= norm;
+  }
+
+  return cn;
+}
+
+void
+corr_noise_free (CorrNoise *cn)
+{
+  if (cn == NULL) return;
+  gsl_fft_real_wavetable_free (cn->row_wt);
+  gsl_fft_halfcomplex_wavetable_free (cn->row_hwt);
+  gsl_fft_real_workspace_free (cn->row_ws);
+  gsl_fft_complex_wavetable_free (cn->col_wt);
+  gsl_fft_complex_workspace_free (cn->col_ws);
+  g_free (cn->row);
+  saw_buffer_free (cn->spec, 2 * sizeof (double) * cn->rows * cn->spec_cols);
+  saw_buffer_free (cn->filter, sizeof (double) * cn->rows * cn->spec_cols);
+  g_free (cn);
+}
+
+/* Fill a rows x cols image with correlated Gaussian noise with zero
+ * mean and unit variance. */
+void
+corr_noise_fill (CorrNoise *cn, const gsl_rng *rng, RutSurface *img)
+{
+  g_assert (img->rows == cn->rows && img->cols == cn->cols);
+
+  int rows = cn->rows, cols = cn->cols, sc = cn->spec_cols;
+  double *row = cn->row;
+
+  /* Transform rows of white noise, and unpack the halfcomplex results
+   * into the spectrum buffer. */
+  for (int i = 0; i < rows; i++) {
+    double *s = cn->spec + 2 * (gsize) i * sc;
+    for (int j = 0; j < cols; j++) {
+      row[j] = gsl_ran_gaussian_ziggurat (rng, 1);
+    }
+    gsl_fft_real_transform (row, 1, cols, cn->row_wt, cn->row_ws);
+    s[0] = row[0];
+    s[1] = 0;
+    for (int j = 1; 2*j < cols; j++) {
+      s[2*j] = row[2*j - 1];
+      s[2*j + 1] = row[2*j];
+    }
+    if (cols % 2 == 0 && cols > 1) {
+      s[cols] = row[cols - 1];
+      s[cols + 1] = 0;
+    }
+  }
+
+  /* Transform columns, filter, and transform back. */
+  for (int j = 0; j < sc; j++) {
+    gsl_fft_complex_forward (cn->spec + 2*j, sc, rows,
+                             cn->col_wt, cn->col_ws);
+  }
+  for (gsize i = 0; i < (gsize) rows * sc; i++) {
+    cn->spec[2*i] *= cn->filter[i];
+    cn->spec[2*i + 1] *= cn->filter[i];
+  }
+  for (int j = 0; j < sc; j++) {
+    gsl_fft_complex_inverse (cn->spec + 2*j, sc, rows,
+                             cn->col_wt, cn->col_ws);
+  }
+
+  /* Pack rows back to halfcomplex format and transform back. */
+  for (int i = 0; i < rows; i++) {
+    const double *s = cn->spec + 2 * (gsize) i * sc;
+    row[0] = s[0];
+    for (int j = 1; 2*j < cols; j++) {
+      row[2*j - 1] = s[2*j];
+      row[2*j] = s[2*j + 1];
+    }
+    if (cols % 2 == 0 && cols > 1) row[cols - 1] = s[cols];
+    gsl_fft_halfcomplex_inverse (row, 1, cols, cn->row_hwt, cn->row_ws);
+    for (int j = 0; j < cols; j++) {
+      RUT_SURFACE_REF (img, i, j) = (float) row[j];
+    }
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* Gamma variates */
+
+/* Gamma variates are generated with the Marsaglia-Tsang method, in
+ * batches.  First, normal and uniform variates for the whole batch are
+ * drawn, and the cheap squeeze test is applied in a branch-free loop;
+ * this accepts over 95% of candidates for any shape >= 1.  Then the
+ * rare failures are fixed up one by one with the full test, and
+ * resampled if necessary.  The cost per variate is therefore nearly
+ * independent of the shape, unlike summing exponential variates.
+ * Shapes below 1 are boosted to shape + 1 and corrected with a power
+ * of a further uniform variate. */
+
+typedef struct _GammaSampler GammaSampler;
+
+struct _GammaSampler
+{
+  double shape;
+  double d, c;
+  int size;
+  double *x, *u;
+  guint8 *ok;
+};
+
+static GammaSampler *
+gamma_sampler_new (double shape, int size)
+{
+  g_assert (shape > 0);
+
+  GammaSampler *gs = g_new0 (GammaSampler, 1);
+  gs->shape = shape;
+  gs->d = ((shape < 1) ? shape + 1 : shape) - 1.0/3;
+  gs->c = 1 / sqrt (9 * gs->d);
+  gs->size = size;
+  gs->x = g_new (double, size);
+  gs->u = g_new (double, size);
+  gs->ok = g_new (guint8, size);
+  return gs;
+}
+
+static void
+gamma_sampler_free (GammaSampler *gs)
+{
+  if (gs == NULL) return;
+  g_free (gs->x);
+  g_free (gs->u);
+  g_free (gs->ok);
+  g_free (gs);
+}
+
+static double
+gamma_mt_sample (const gsl_rng *rng, double d, double c)
+{
+  for (;;) {
+    double x, v;
+    do {
+      x = gsl_ran_gaussian_ziggurat (rng, 1);
+      v = 1 + c * x;
+    } while (v <= 0);
+    v = v * v * v;
+    double u = gsl_rng_uniform_pos (rng);
+    if (u < 1 - 0.0331 * x*x*x*x) return d * v;
+    if (log (u) < 0.5 * x*x + d * (1 - v + log (v))) return d * v;
+  }
+}
+
+/* Fill out with a batch of gamma variates with unit scale. */
+static void
+gamma_sampler_fill (GammaSampler *gs, const gsl_rng *rng, double *out)
+{
+  double d = gs->d, c = gs->c;
+  double *x = gs->x, *u = gs->u;
+  guint8 *ok = gs->ok;
+  int n = gs->size;
+
+  for (int j = 0; j < n; j++) {
+    x[j] = gsl_ran_gaussian_ziggurat (rng, 1);
+    u[j] = gsl_rng_uniform_pos (rng);
+  }
+
+  /* Squeeze pass */
+  for (int j = 0; j < n; j++) {
+    double v = 1 + c * x[j];
+    double x2 = x[j] * x[j];
+    out[j] = d * v*v*v;
+    ok[j] = (v > 0) & (u[j] < 1 - 0.0331 * x2*x2);
+  }
+
+  /* Fix-up pass */
+  for (int j = 0; j < n; j++) {
+    if (ok[j]) continue;
+    double v = 1 + c * x[j];
+    if (v > 0) {
+      v = v * v * v;
+      if (log (u[j]) < 0.5 * x[j]*x[j] + d * (1 - v + log (v))) continue;
+    }
+    out[j] = gamma_mt_sample (rng, d, c);
+  }
+
+  if (gs->shape < 1) {
+    for (int j = 0; j < n; j++) {
+      out[j] *= pow (gsl_rng_uniform_pos (rng), 1 / gs->shape);
+    }
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* Noise generators */
+
+/* Each type of noise is described by an entry in noise_types.  The
+ * init function parses the type's parameter, if any, and sets up any
+ * state needed; the fill function then fills a whole image at a
+ * time.
+ *
+ * Amplitude distributions are scaled so that the single-look speckle
+ * 'S' is a Rayleigh distribution with unit scale, and speckle-like
+ * types tend to it in the appropriate limit. */
+
+typedef struct _NoiseType NoiseType;
+
+struct _NoiseType
+{
+  const char *name;
+  const char *param_name;    /* NULL if there is no parameter */
+  const char *default_param;
+  const char *description;
+  int (*init) (NoiseSource *src, const char *param);
+  void (*fill) (NoiseSource *src, const gsl_rng *rng, RutSurface *img);
+  void (*finish) (NoiseSource *src);
+};
+
+struct _NoiseSource
+{
+  const NoiseType *type;
+  int rows, cols;
+  double param;
+  double *buf;               /* Row buffer */
+  GammaSampler *gamma;
+  CorrNoise *corr;
+};
+
+static int
+noise_parse_positive (NoiseSource *src, const char *param)
+{
+  char *end;
+  src->param = strtod (param, &end);
+  return (end != param && *end == '\0' && src->param > 0);
+}
+
+static void
+noise_fill_speckle (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      row[j] = (float) gsl_ran_rayleigh (rng, 1);
+    }
+  }
+}
+
+static void
+noise_fill_norm (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      row[j] = (float) gsl_ran_gaussian_ziggurat (rng, 1);
+    }
+  }
+}
+
+static void
+noise_fill_uniform (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      row[j] = (float) gsl_rng_uniform (rng);
+    }
+  }
+}
+
+static void
+noise_fill_exponential (NoiseSource *src, const gsl_rng *rng,
+                        RutSurface *img)
+{
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      row[j] = (float) -log (gsl_rng_uniform_pos (rng));
+    }
+  }
+}
+
+/* Set up a gamma sampler with the parameter as its shape. */
+static int
+noise_init_gamma (NoiseSource *src, const char *param)
+{
+  if (!noise_parse_positive (src, param)) return 0;
+  src->gamma = gamma_sampler_new (src->param, src->cols);
+  src->buf = g_new (double, src->cols);
+  return 1;
+}
+
+/* Multi-look speckle: the intensity of L-look speckle is gamma
+ * distributed with shape L, so with scale 2/L the amplitude is
+ * Rayleigh distributed for L = 1. */
+static void
+noise_fill_multilook (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  double scale = 2 / src->param;
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    gamma_sampler_fill (src->gamma, rng, src->buf);
+    for (int j = 0; j < img->cols; j++) {
+      row[j] = (float) sqrt (src->buf[j] * scale);
+    }
+  }
+}
+
+/* K-distributed clutter: single-look speckle modulated by a gamma
+ * distributed texture with shape NU and unit mean.  Tends to 'S' as
+ * NU tends to infinity. */
+static void
+noise_fill_k (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  double scale = 2 / src->param;
+  for (int i = 0; i < img->rows; i++) {
+    float *row = &RUT_SURFACE_REF (img, i, 0);
+    gamma_sampler_fill (src->gamma, rng, src->buf);
+    for (int j = 0; j < img->cols; j++) {
+      double speckle = -log (gsl_rng_uniform_pos (rng));
+      row[j] = (float) sqrt (src->buf[j] * scale * speckle);
+    }
+  }
+}
+
+static int
+noise_init_correlated (NoiseSource *src, const char *param)
+{
+  CorrSpectrum spectrum;
+  if (!corr_spectrum_parse (param, &spectrum)) return 0;
+  src->corr = corr_noise_new (src->rows, src->cols, &spectrum);
+  return 1;
+}
+
+static void
+noise_fill_correlated (NoiseSource *src, const gsl_rng *rng,
+                       RutSurface *img)
+{
+  corr_noise_fill (src->corr, rng, img);
+}
+
+static const NoiseType noise_types[] = {
+  {"S", NULL, NULL,
+   "Single-look speckle (Rayleigh distributed amplitude)",
+   NULL, noise_fill_speckle, NULL},
+  {"N", NULL, NULL,
+   "Gaussian white noise",
+   NULL, noise_fill_norm, NULL},
+  {"U", NULL, NULL,
+   "Uniform white noise on [0, 1)",
+   NULL, noise_fill_uniform, NULL},
+  {"E", NULL, NULL,
+   "Exponential white noise (single-look speckle intensity)",
+   NULL, noise_fill_exponential, NULL},
+  {"G", "LOOKS", "4",
+   "Multi-look speckle amplitude, averaged over LOOKS looks",
+   noise_init_gamma, noise_fill_multilook, NULL},
+  {"K", "NU", "2",
+   "K-distributed clutter amplitude, with texture shape NU",
+   noise_init_gamma, noise_fill_k, NULL},
+  {"C", "SPECTRUM", "gauss:4",
+   "Spatially correlated Gaussian noise; SPECTRUM is 'gauss:L' or\n"
+   "'exp:L' for Gaussian or exponential correlation with length L\n"
+   "pixels, or 'power:BETA' for a power spectrum k^-BETA",
+   noise_init_correlated, noise_fill_correlated, NULL},
+};
+
+/* Create a noise source for images of rows x cols pixels from a
+ * specification in the format "TYPE[:PARAM]".  Returns NULL if the
+ * specification is invalid. */
+NoiseSource *
+noise_source_new (const char *spec, int rows, int cols)
+{
+  g_assert (spec);
+
+  const char *sep = strchr (spec, ':');
+  size_t name_len = sep ? (size_t) (sep - spec) : strlen (spec);
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS (noise_types); i++) {
+    const NoiseType *type = &noise_types[i];
+    if (strlen (type->name) != name_len
+        || strncmp (spec, type->name, name_len) != 0) {
+      continue;
+    }
+    if (sep != NULL && type->param_name == NULL) return NULL;
+
+    NoiseSource *src = g_new0 (NoiseSource, 1);
+    src->type = type;
+    src->rows = rows;
+    src->cols = cols;
+    if (type->init != NULL
+        && !type->init (src, sep ? sep + 1 : type->default_param)) {
+      noise_source_free (src);
+      return NULL;
+    }
+    return src;
+  }
+  return NULL;
+}
+
+void
+noise_source_free (NoiseSource *src)
+{
+  if (src == NULL) return;
+  if (src->type->finish != NULL) src->type->finish (src);
+  gamma_sampler_free (src->gamma);
+  corr_noise_free (src->corr);
+  g_free (src->buf);
+  g_free (src);
+}
+
+/* Size of a noise source's image-sized buffers, as charged against the
+ * memory limit. */
+gsize
+noise_source_size (const NoiseSource *src)
+{
+  if (src->corr == NULL) return 0;
+  return 3 * sizeof (double) * src->corr->rows * src->corr->spec_cols;
+}
+
+/* Fill an image with noise.  The image must have the size given when
+ * the noise source was created. */
+void
+noise_source_fill (NoiseSource *src, const gsl_rng *rng, RutSurface *img)
+{
+  g_assert (img->rows == src->rows && img->cols == src->cols);
+  src->type->fill (src, rng, img);
+}
+
+/* SplitMix64 output function */
+guint64
+noise_mix64 (guint64 z)
+{
+  z += G_GUINT64_CONSTANT (0x9E3779B97F4A7C15);
+  z = (z ^ (z >> 30)) * G_GUINT64_CONSTANT (0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * G_GUINT64_CONSTANT (0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
+
+/* Derive the random seed for a generated tile from the master seed and
+ * the tile index, so that any tile can be regenerated on its own.  Both
+ * are mixed thoroughly, so that nearby seeds and indices give unrelated
+ * streams.
+ *
+ * The default generator (and most others in GSL) only uses the low 32
+ * bits of its seed, so the mixed value is folded down to 32 bits
+ * rather than truncated.  Tile streams are therefore only distinct
+ * with high probability: among k tiles, some pair shares a seed with
+ * probability about k^2 / 2^33, which becomes likely at around 10^5
+ * tiles. */
+static unsigned long
+noise_tile_seed (unsigned long seed, int tile)
+{
+  guint64 z = noise_mix64 (noise_mix64 (seed) ^ (guint64) tile);
+  return (unsigned long) ((z >> 32) ^ (z & 0xFFFFFFFF));
+}
+
+/* Fill an image with the noise for tile number tile, reseeding rng
+ * from the master seed. */
+void
+noise_source_fill_tile (NoiseSource *src, gsl_rng *rng, unsigned long seed,
+                        int tile, RutSurface *img)
+{
+  gsl_rng_set (rng, noise_tile_seed (seed, tile));
+  noise_source_fill (src, rng, img);
+}
+
+/* Print a description of the available noise types for the usage
+ * message. */
+void
+noise_print_types (FILE *fp)
+{
+  for (unsigned int i = 0; i < G_N_ELEMENTS (noise_types); i++) {
+    const NoiseType *type = &noise_types[i];
+    gchar *name;
+    if (type->param_name != NULL) {
+      name = g_strdup_printf ("%s[:%s]", type->name, type->param_name);
+    } else {
+      name = g_strdup (type->name);
+    }
+    fprintf (fp, "  %-16s", name);
+    g_free (name);
+
+    /* Indent continuation lines of the description */
+    for (const char *p = type->description; *p; p++) {
+      fputc (*p, fp);
+      if (*p == '\n') fprintf (fp, "%18s", "");
+    }
+    if (type->default_param != NULL) {
+      fprintf (fp, "\n%18s[default: %s]", "", type->default_param);
+    }
+    fputc ('\n', fp);
+  }
+}
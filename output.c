@@ -0,0 +1,551 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#include "ridge-saw.h"
+
+/* ---------------------------------------------------------------- */
+/* Aggregate statistics */
+
+SawStats *
+saw_stats_new (void)
+{
+  return g_new0 (SawStats, 1);
+}
+
+void
+saw_stats_free (SawStats *stats)
+{
+  if (stats == NULL) return;
+  g_free (stats->weight);
+  g_free (stats->sum_dx2);
+  g_free (stats->sum_dy2);
+  g_free (stats->sum_dxdy);
+  g_free (stats);
+}
+
+static void
+saw_stats_reserve (SawStats *stats, int num_steps)
+{
+  if (num_steps < stats->size) return;
+
+  int size = MAX (stats->size, 64);
+  while (size <= num_steps) size *= 2;
+
+  stats->weight = g_renew (double, stats->weight, size);
+  stats->sum_dx2 = g_renew (double, stats->sum_dx2, size);
+  stats->sum_dy2 = g_renew (double, stats->sum_dy2, size);
+  stats->sum_dxdy = g_renew (double, stats->sum_dxdy, size);
+  for (int i = stats->size; i < size; i++) {
+    stats->weight[i] = 0;
+    stats->sum_dx2[i] = 0;
+    stats->sum_dy2[i] = 0;
+    stats->sum_dxdy[i] = 0;
+  }
+  stats->size = size;
+}
+
+void
+saw_stats_add (SawStats *stats, int num_steps, double dx, double dy,
+               double weight)
+{
+  saw_stats_add_sums (stats, num_steps, weight, weight * dx*dx,
+                      weight * dy*dy, weight * dx*dy);
+}
+
+/* Add precomputed sums of weights and weighted squared displacement
+ * components. */
+void
+saw_stats_add_sums (SawStats *stats, int num_steps, double weight,
+                    double sum_dx2, double sum_dy2, double sum_dxdy)
+{
+  g_assert (num_steps >= 0);
+  saw_stats_reserve (stats, num_steps);
+  stats->weight[num_steps] += weight;
+  stats->sum_dx2[num_steps] += sum_dx2;
+  stats->sum_dy2[num_steps] += sum_dy2;
+  stats->sum_dxdy[num_steps] += sum_dxdy;
+}
+
+void
+saw_stats_merge (SawStats *stats, const SawStats *other)
+{
+  if (other->size == 0) return;
+  saw_stats_reserve (stats, other->size - 1);
+  for (int i = 0; i < other->size; i++) {
+    stats->weight[i] += other->weight[i];
+    stats->sum_dx2[i] += other->sum_dx2[i];
+    stats->sum_dy2[i] += other->sum_dy2[i];
+    stats->sum_dxdy[i] += other->sum_dxdy[i];
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* Asynchronous writer */
+
+/* Formatted records are passed to a writer thread in fixed-size
+ * blocks, through a single-producer, single-consumer ring.  The
+ * producer is whichever thread holds the output mutex, so the ring
+ * itself needs no locks: the producer fills the block at head and
+ * then advances head, and the writer thread writes out the block at
+ * tail and then advances tail.  The wait mutex and condition are only
+ * used to sleep when the ring is full (backpressure) or empty.
+ *
+ * If output is compressed, each published block is also handed to a
+ * pool of compression threads, which set the block's ready flag when
+ * done.  The writer thread still takes blocks strictly in ring order,
+ * so compressed blocks are written in the order they were filled.
+ * Compressed blocks are larger, to keep the compression ratio
+ * reasonable. */
+
+#define SAW_WRITER_BLOCK_SIZE (64 * 1024)
+#define SAW_WRITER_COMPRESS_BLOCK_SIZE (1024 * 1024)
+
+struct _SawWriter
+{
+  FILE *fp;
+  GThread *thread;
+  gsize block_size;
+  guint num_blocks;
+  gchar **blocks;
+  gsize *lens;
+  volatile gint head;     /* Count of blocks published */
+  volatile gint tail;     /* Count of blocks written */
+  volatile gint done;
+  volatile gint error;    /* errno of a failed write, or 0 */
+  GMutex wait_mutex;
+  GCond wait_cond;
+  gint64 stall_time;      /* Time producers spent waiting, in us */
+
+  /* Compression */
+  SawCompression compression;
+  GThreadPool *pool;
+  gchar **cblocks;
+  gsize *clens;
+  volatile gint *ready;
+};
+
+static void
+saw_writer_wake (SawWriter *w)
+{
+  g_mutex_lock (&w->wait_mutex);
+  g_cond_broadcast (&w->wait_cond);
+  g_mutex_unlock (&w->wait_mutex);
+}
+
+/* Compress one block.  Called from the compression thread pool. */
+static void
+saw_writer_compress (gpointer data, gpointer user_data)
+{
+  SawWriter *w = (SawWriter *) user_data;
+  guint i = GPOINTER_TO_UINT (data) - 1;
+
+  w->clens[i] = saw_compress_block (w->compression, w->blocks[i], w->lens[i],
+                                    w->cblocks[i],
+                                    saw_compress_bound (w->compression,
+                                                        w->block_size));
+  g_atomic_int_set (&w->ready[i], 1);
+  saw_writer_wake (w);
+}
+
+/* Check whether the block at tail can be written out yet. */
+static gboolean
+saw_writer_tail_ready (SawWriter *w, guint tail)
+{
+  if ((guint) g_atomic_int_get (&w->head) == tail) return FALSE;
+  return (w->pool == NULL
+          || g_atomic_int_get (&w->ready[tail % w->num_blocks]));
+}
+
+static gpointer
+saw_writer_thread (gpointer user_data)
+{
+  SawWriter *w = (SawWriter *) user_data;
+
+  for (;;) {
+    guint tail = g_atomic_int_get (&w->tail);
+
+    g_mutex_lock (&w->wait_mutex);
+    while (!saw_writer_tail_ready (w, tail)
+           && !((guint) g_atomic_int_get (&w->head) == tail
+                && g_atomic_int_get (&w->done))) {
+      g_cond_wait (&w->wait_cond, &w->wait_mutex);
+    }
+    g_mutex_unlock (&w->wait_mutex);
+    if ((guint) g_atomic_int_get (&w->head) == tail) break;
+
+    guint i = tail % w->num_blocks;
+    const gchar *data = w->blocks[i];
+    gsize len = w->lens[i];
+    if (w->pool != NULL) {
+      data = w->cblocks[i];
+      len = w->clens[i];
+      g_atomic_int_set (&w->ready[i], 0);
+      if (len == 0 && w->lens[i] > 0 && !g_atomic_int_get (&w->error)) {
+        g_atomic_int_set (&w->error, EIO); /* Compression failed */
+      }
+    }
+    if (!g_atomic_int_get (&w->error)
+        && fwrite (data, 1, len, w->fp) != len) {
+      g_atomic_int_set (&w->error, errno ? errno : EIO);
+    }
+    w->lens[i] = 0;
+    g_atomic_int_set (&w->tail, tail + 1);
+    saw_writer_wake (w);
+  }
+
+  if (fflush (w->fp) != 0 && !g_atomic_int_get (&w->error)) {
+    g_atomic_int_set (&w->error, errno ? errno : EIO);
+  }
+  return NULL;
+}
+
+/* Memory used by a writer's buffers, in bytes. */
+static gsize
+saw_writer_size (const SawWriter *w)
+{
+  gsize size = w->block_size;
+  if (w->cblocks != NULL) {
+    size += saw_compress_bound (w->compression, w->block_size);
+  }
+  return size * w->num_blocks;
+}
+
+static SawWriter *
+saw_writer_new (FILE *fp, gsize buffer_size, SawCompression compression,
+                int num_threads)
+{
+  SawWriter *w = g_new0 (SawWriter, 1);
+  w->fp = fp;
+  w->compression = compression;
+  if (compression == SAW_COMPRESS_NONE) {
+    w->block_size = SAW_WRITER_BLOCK_SIZE;
+    w->num_blocks = MAX (2, buffer_size / w->block_size);
+  } else {
+    /* Enough blocks to keep every compression thread busy while one
+     * block is being filled and another written. */
+    w->block_size = SAW_WRITER_COMPRESS_BLOCK_SIZE;
+    w->num_blocks = MAX ((guint) num_threads + 2,
+                         buffer_size / w->block_size);
+  }
+  w->blocks = g_new (gchar *, w->num_blocks);
+  w->lens = g_new0 (gsize, w->num_blocks);
+  for (guint i = 0; i < w->num_blocks; i++) {
+    w->blocks[i] = g_malloc (w->block_size);
+  }
+
+  if (compression != SAW_COMPRESS_NONE) {
+    gsize bound = saw_compress_bound (compression, w->block_size);
+    w->cblocks = g_new (gchar *, w->num_blocks);
+    w->clens = g_new0 (gsize, w->num_blocks);
+    w->ready = g_new0 (gint, w->num_blocks);
+    for (guint i = 0; i < w->num_blocks; i++) {
+      w->cblocks[i] = g_malloc (bound);
+    }
+    w->pool = g_thread_pool_new (saw_writer_compress, w, MAX (num_threads, 1),
+                                 TRUE, NULL);
+  }
+  saw_mem_charge (saw_writer_size (w));
+
+  g_mutex_init (&w->wait_mutex);
+  g_cond_init (&w->wait_cond);
+  w->thread = g_thread_new ("writer", saw_writer_thread, w);
+  return w;
+}
+
+/* Hand the block at head to the writer thread, and wait for the next
+ * one to be free. */
+static void
+saw_writer_publish (SawWriter *w)
+{
+  guint i = (guint) g_atomic_int_get (&w->head) % w->num_blocks;
+  if (w->pool != NULL) {
+    g_thread_pool_push (w->pool, GUINT_TO_POINTER (i + 1), NULL);
+  }
+
+  guint head = g_atomic_int_get (&w->head) + 1;
+  g_atomic_int_set (&w->head, head);
+  saw_writer_wake (w);
+
+  if (head - (guint) g_atomic_int_get (&w->tail) < w->num_blocks) return;
+
+  gint64 start = g_get_monotonic_time ();
+  g_mutex_lock (&w->wait_mutex);
+  while (head - (guint) g_atomic_int_get (&w->tail) >= w->num_blocks) {
+    g_cond_wait (&w->wait_cond, &w->wait_mutex);
+  }
+  g_mutex_unlock (&w->wait_mutex);
+  w->stall_time += g_get_monotonic_time () - start;
+}
+
+/* Append formatted data.  Must be called with the output mutex
+ * held. */
+static int
+saw_writer_append (SawWriter *w, const char *data, gsize len)
+{
+  g_assert (len <= w->block_size);
+
+  guint i = (guint) g_atomic_int_get (&w->head) % w->num_blocks;
+  if (w->lens[i] + len > w->block_size) {
+    saw_writer_publish (w);
+    i = (guint) g_atomic_int_get (&w->head) % w->num_blocks;
+  }
+  memcpy (w->blocks[i] + w->lens[i], data, len);
+  w->lens[i] += len;
+
+  int err = g_atomic_int_get (&w->error);
+  if (err) errno = err;
+  return !err;
+}
+
+/* Write out any remaining data, and stop the writer and compression
+ * threads.  Returns 0 if any write failed. */
+static int
+saw_writer_finish (SawWriter *w)
+{
+  guint i = (guint) g_atomic_int_get (&w->head) % w->num_blocks;
+  if (w->lens[i] > 0) saw_writer_publish (w);
+
+  g_atomic_int_set (&w->done, 1);
+  saw_writer_wake (w);
+  g_thread_join (w->thread);
+  w->thread = NULL;
+
+  /* The writer thread has waited for every block to be compressed, so
+   * the pool is idle. */
+  if (w->pool != NULL) {
+    g_thread_pool_free (w->pool, FALSE, TRUE);
+    w->pool = NULL;
+  }
+
+  int err = g_atomic_int_get (&w->error);
+  if (err) errno = err;
+  return !err;
+}
+
+static void
+saw_writer_free (SawWriter *w)
+{
+  if (w == NULL) return;
+  if (w->thread != NULL) saw_writer_finish (w);
+  saw_mem_credit (saw_writer_size (w));
+  for (guint i = 0; i < w->num_blocks; i++) {
+    g_free (w->blocks[i]);
+    if (w->cblocks != NULL) g_free (w->cblocks[i]);
+  }
+  g_free (w->blocks);
+  g_free (w->lens);
+  g_free (w->cblocks);
+  g_free (w->clens);
+  g_free ((gint *) w->ready);
+  g_mutex_clear (&w->wait_mutex);
+  g_cond_clear (&w->wait_cond);
+  g_free (w);
+}
+
+/* ---------------------------------------------------------------- */
+/* Output */
+
+SawOutput *
+saw_output_new (FILE *fp, gboolean aggregate, gboolean weighted,
+                gboolean components)
+{
+  g_assert (fp);
+
+  SawOutput *out = g_new0 (SawOutput, 1);
+  out->fp = fp;
+  out->weighted = weighted;
+  out->components = components;
+  if (aggregate) out->stats = saw_stats_new ();
+  g_mutex_init (&out->mutex);
+  return out;
+}
+
+void
+saw_output_free (SawOutput *out)
+{
+  if (out == NULL) return;
+  saw_writer_free (out->writer);
+  saw_stats_free (out->stats);
+  g_mutex_clear (&out->mutex);
+  g_free (out);
+}
+
+/* Write output from a separate thread, buffering up to buffer_size
+ * bytes.  Producers are held up if the buffer fills.  If output is
+ * compressed, blocks are compressed by num_threads threads. */
+void
+saw_output_start_writer (SawOutput *out, gsize buffer_size,
+                         SawCompression compression, int num_threads)
+{
+  g_assert (out->writer == NULL);
+  out->writer = saw_writer_new (out->fp, buffer_size, compression,
+                                num_threads);
+}
+
+/* Write a formatted line of output, either directly or through the
+ * writer.  Must be called with the output mutex held, or after all
+ * producers have finished.  Returns 0 on failure. */
+static int
+saw_output_printf (SawOutput *out, const char *format, ...)
+{
+  va_list ap;
+  int status;
+
+  va_start (ap, format);
+  if (out->writer != NULL) {
+    char buf[256];
+    int len = g_vsnprintf (buf, sizeof (buf), format, ap);
+    status = saw_writer_append (out->writer, buf,
+                                MIN ((gsize) len, sizeof (buf) - 1));
+  } else {
+    status = (vfprintf (out->fp, format, ap) >= 0);
+  }
+  va_end (ap);
+  return status;
+}
+
+static int
+saw_output_add (SawOutput *out, int tile, int num_steps, double dx,
+                double dy, double weight)
+{
+  int status = 1;
+
+  if (out->histogram != NULL) {
+    saw_histogram_add (out->histogram, num_steps, dx, dy, weight);
+  }
+
+  g_mutex_lock (&out->mutex);
+  out->num_records++;
+  if (out->stats != NULL) {
+    saw_stats_add (out->stats, num_steps, dx, dy, weight);
+  } else {
+    double dist = sqrt (dx*dx + dy*dy);
+
+    /* Displacements are always whole pixels or lattice steps. */
+    char components[64] = "";
+    if (out->components) {
+      g_snprintf (components, sizeof (components), ", %.0f, %.0f", dx, dy);
+    }
+
+    /* Output is in the format "num_steps, distance", with an extra
+     * "weight" field for weighted samples, or "tile" field for
+     * records from generated tiles, and then "dx, dy" fields if
+     * components were requested. */
+    if (out->weighted) {
+      status = saw_output_printf (out, "%i, %f, %g%s\n",
+                                  num_steps, dist, weight, components);
+    } else if (tile >= 0) {
+      status = saw_output_printf (out, "%i, %f, %i%s\n",
+                                  num_steps, dist, tile, components);
+    } else {
+      status = saw_output_printf (out, "%i, %f%s\n", num_steps, dist,
+                                  components);
+    }
+  }
+  g_mutex_unlock (&out->mutex);
+  return status;
+}
+
+/* Output a single line or walk record, or add it to the aggregate
+ * statistics.  May be called from multiple threads.  Returns 0 on
+ * failure. */
+int
+saw_output_record (SawOutput *out, int num_steps, double dx, double dy,
+                   double weight)
+{
+  return saw_output_add (out, -1, num_steps, dx, dy, weight);
+}
+
+/* Output a line record from a generated tile, including the tile
+ * index so that the tile can be regenerated. */
+int
+saw_output_tile_record (SawOutput *out, int tile, int num_steps, double dx,
+                        double dy)
+{
+  g_assert (tile >= 0);
+  g_assert (!out->weighted);
+  return saw_output_add (out, tile, num_steps, dx, dy, 1);
+}
+
+/* Output a header comment line, prefixed with "#".  Must be called
+ * before any records are output.  Returns 0 on failure. */
+int
+saw_output_comment (SawOutput *out, const char *text)
+{
+  g_assert (out->num_records == 0);
+
+  g_mutex_lock (&out->mutex);
+  int status = saw_output_printf (out, "# %s\n", text);
+  g_mutex_unlock (&out->mutex);
+  return status;
+}
+
+/* Add statistics accumulated separately by a generator thread. */
+void
+saw_output_merge_stats (SawOutput *out, const SawStats *stats)
+{
+  g_assert (out->stats);
+
+  g_mutex_lock (&out->mutex);
+  saw_stats_merge (out->stats, stats);
+  g_mutex_unlock (&out->mutex);
+}
+
+/* Write out aggregate statistics and any buffered records.  Aggregate
+ * statistics are in the format "num_steps, mean_sq_distance, weight",
+ * followed by "mean_dx2, mean_dy2, mean_dxdy" if components were
+ * requested, skipping step counts with no data.  Returns 0 on
+ * failure. */
+int
+saw_output_finish (SawOutput *out)
+{
+  int status = 1;
+
+  if (out->stats != NULL) {
+    const SawStats *stats = out->stats;
+    for (int i = 0; status && i < stats->size; i++) {
+      if (stats->weight[i] <= 0) continue;
+      double w = stats->weight[i];
+      double r2 = (stats->sum_dx2[i] + stats->sum_dy2[i]) / w;
+      if (out->components) {
+        status = saw_output_printf (out, "%i, %f, %.15g, %f, %f, %f\n", i,
+                                    r2, w, stats->sum_dx2[i] / w,
+                                    stats->sum_dy2[i] / w,
+                                    stats->sum_dxdy[i] / w);
+      } else {
+        status = saw_output_printf (out, "%i, %f, %.15g\n", i, r2, w);
+      }
+    }
+  }
+
+  if (out->writer != NULL) {
+    if (!saw_writer_finish (out->writer)) status = 0;
+    if (out->writer->stall_time >= 1000) {
+      fprintf (stderr, "Output stalled for %.3f s waiting for writer\n",
+               out->writer->stall_time / 1e6);
+    }
+  }
+  return status;
+}
@@ -0,0 +1,250 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ridge-saw.h"
+
+/* Reference self-avoiding walks on the square lattice, sampled with
+ * the pruned-enriched Rosenbluth method (Grassberger, Phys. Rev. E 56,
+ * 1997).
+ *
+ * Walks are grown one step at a time into a randomly chosen free
+ * neighbour, and carry the Rosenbluth weight (the product of the
+ * number of free neighbours at each step).  The raw weight grows like
+ * the number of walks, mu^N, and would overflow a double at around
+ * 700 steps, so it is divided by PERM_MU at each step; the weights of
+ * walks of the same length keep the same ratios, and the thresholds
+ * below are relative anyway.  When the weight of a walk
+ * rises above an upper threshold, it is enriched by continuing two
+ * copies with half the weight each; when it falls below a lower
+ * threshold, it is pruned with probability 1/2 or continued with
+ * double weight.  The thresholds track a running estimate of the
+ * partition sum at each length.  Each tour grows the tree of copies
+ * depth-first from a single walk at the origin, and every walk visited
+ * is a weighted sample of its length.
+ *
+ * Tours are independent, so they are shared out between threads.  Each
+ * thread keeps its own threshold estimates and random number
+ * generator. */
+
+/* Enrichment and pruning thresholds, relative to the estimated
+ * partition sum. */
+#define PERM_ENRICH_THRESHOLD 3.0
+#define PERM_PRUNE_THRESHOLD 0.3
+
+/* Connective constant of the square lattice (Jensen, J. Phys. A 37,
+ * 2004), by which weights are divided at each step. */
+#define PERM_MU 2.63815853
+
+static const int perm_steps[4][2] = { {1, 0}, {0, 1}, {-1, 0}, {0, -1} };
+
+typedef struct _PermJob PermJob;
+typedef struct _PermWorker PermWorker;
+
+struct _PermJob
+{
+  int length;
+  int num_tours;
+  volatile gint next_tour;
+  volatile gint failed;
+  SawOutput *out;
+};
+
+struct _PermWorker
+{
+  PermJob *job;
+  gsl_rng *rng;
+  GThread *thread;
+
+  gint32 *x, *y;   /* Sites of current walk */
+  int *remaining;  /* Copies still to be grown from each length */
+  double *weight;  /* Weight of each copy at each length */
+  SawSiteHash *hash;
+
+  double *sum_weight; /* Partition sum estimates, before division by
+                       * the number of tours */
+  int num_tours;
+  int max_reached;    /* Longest walk grown by previous tours */
+  int tour_reached;   /* Longest walk grown by current tour */
+  SawStats *stats;    /* Only used for aggregate output */
+};
+
+static int
+perm_sample (PermWorker *w, int n, double weight)
+{
+  double dx = w->x[n], dy = w->y[n];
+
+  w->sum_weight[n] += weight;
+  w->tour_reached = MAX (w->tour_reached, n);
+  if (n == 0) return 1;
+
+  if (w->stats != NULL) {
+    saw_stats_add (w->stats, n, dx, dy, weight);
+    if (w->job->out->histogram != NULL) {
+      saw_histogram_add (w->job->out->histogram, n, dx, dy, weight);
+    }
+    return 1;
+  }
+  return saw_output_record (w->job->out, n, dx, dy, weight);
+}
+
+/* Decide how many copies of the walk at length n to continue, and with
+ * what weight each. */
+static void
+perm_branch (PermWorker *w, int n, double weight)
+{
+  int copies = 1;
+
+  if (n >= w->job->length) {
+    copies = 0;
+  } else if (n <= w->max_reached) {
+    /* Thresholds are only applied at lengths reached by previous
+     * tours.  Elsewhere (including throughout the first tour) this is
+     * plain Rosenbluth sampling, because there are no partition sum
+     * estimates yet. */
+    double z = w->sum_weight[n] / w->num_tours;
+    if (weight > PERM_ENRICH_THRESHOLD * z) {
+      copies = 2;
+      weight /= 2;
+    } else if (weight < PERM_PRUNE_THRESHOLD * z) {
+      if (gsl_rng_uniform (w->rng) < 0.5) {
+        copies = 0;
+      } else {
+        weight *= 2;
+      }
+    }
+  }
+
+  w->remaining[n] = copies;
+  w->weight[n] = weight;
+}
+
+/* Run a single tour.  Returns 0 on output failure. */
+static int
+perm_tour (PermWorker *w)
+{
+  int n = 0;
+  int free_steps[4];
+
+  w->num_tours++;
+  w->tour_reached = 0;
+  saw_site_hash_clear (w->hash);
+  w->x[0] = w->y[0] = 0;
+  saw_site_hash_insert (w->hash, 0, 0, 0);
+
+  perm_sample (w, 0, 1);
+  perm_branch (w, 0, 1);
+
+  while (n >= 0) {
+    if (w->remaining[n] == 0) {
+      /* All copies done; backtrack */
+      saw_site_hash_remove (w->hash, w->x[n], w->y[n]);
+      n--;
+      continue;
+    }
+    w->remaining[n]--;
+
+    int m = 0;
+    for (int i = 0; i < 4; i++) {
+      gint32 nx = w->x[n] + perm_steps[i][0];
+      gint32 ny = w->y[n] + perm_steps[i][1];
+      if (saw_site_hash_lookup (w->hash, nx, ny) < 0) {
+        free_steps[m++] = i;
+      }
+    }
+    if (m == 0) continue; /* Trapped */
+
+    int s = free_steps[(m > 1) ? gsl_rng_uniform_int (w->rng, m) : 0];
+    double weight = w->weight[n] * m / PERM_MU;
+    w->x[n+1] = w->x[n] + perm_steps[s][0];
+    w->y[n+1] = w->y[n] + perm_steps[s][1];
+    n++;
+    saw_site_hash_insert (w->hash, w->x[n], w->y[n], n);
+
+    if (!perm_sample (w, n, weight)) return 0;
+    perm_branch (w, n, weight);
+  }
+
+  w->max_reached = MAX (w->max_reached, w->tour_reached);
+  return 1;
+}
+
+static gpointer
+perm_worker_thread (gpointer user_data)
+{
+  PermWorker *w = (PermWorker *) user_data;
+  PermJob *job = w->job;
+
+  while (!g_atomic_int_get (&job->failed) && !saw_shutdown_requested ()
+         && g_atomic_int_add (&job->next_tour, 1) < job->num_tours) {
+    if (!perm_tour (w)) {
+      g_atomic_int_set (&job->failed, 1);
+    }
+  }
+  return NULL;
+}
+
+/* Run num_tours PERM tours growing walks of up to length steps, using
+ * num_threads threads, and output weighted samples.  Returns 0 on
+ * output failure. */
+int
+perm_generate (gsl_rng *rng, int length, int num_tours, int num_threads,
+               SawOutput *out)
+{
+  g_assert (rng);
+  g_assert (length > 0);
+  g_assert (num_threads > 0);
+  g_assert (out);
+
+  PermJob job = {length, num_tours, 0, 0, out};
+  PermWorker *workers = g_new0 (PermWorker, num_threads);
+
+  for (int i = 0; i < num_threads; i++) {
+    PermWorker *w = &workers[i];
+    w->job = &job;
+    w->rng = gsl_rng_alloc (gsl_rng_default);
+    gsl_rng_set (w->rng, gsl_rng_get (rng));
+    w->x = g_new (gint32, length + 1);
+    w->y = g_new (gint32, length + 1);
+    w->remaining = g_new (int, length + 1);
+    w->weight = g_new (double, length + 1);
+    w->hash = saw_site_hash_new (length + 1);
+    w->sum_weight = g_new0 (double, length + 1);
+    if (out->stats != NULL) w->stats = saw_stats_new ();
+    w->thread = g_thread_new ("perm", perm_worker_thread, w);
+  }
+
+  for (int i = 0; i < num_threads; i++) {
+    PermWorker *w = &workers[i];
+    g_thread_join (w->thread);
+    if (w->stats != NULL) saw_output_merge_stats (out, w->stats);
+
+    gsl_rng_free (w->rng);
+    g_free (w->x);
+    g_free (w->y);
+    g_free (w->remaining);
+    g_free (w->weight);
+    saw_site_hash_free (w->hash);
+    g_free (w->sum_weight);
+    saw_stats_free (w->stats);
+  }
+  g_free (workers);
+
+  return !job.failed;
+}
@@ -0,0 +1,171 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ridge-saw.h"
+
+/* Reference self-avoiding walks on the square lattice, sampled with
+ * the pivot algorithm (Madras & Sokal, J. Stat. Phys. 50, 1988).
+ *
+ * The walk starts as a straight rod.  Each attempted move picks a
+ * pivot site and applies a random lattice symmetry to the part of the
+ * walk on one side of it.  The site hash maps every occupied site to
+ * its step index, so the new sites can be checked against the fixed
+ * part of the walk in O(1) each.  The shorter side is always the one
+ * that is moved; the result differs only by a global symmetry, which
+ * does not change the end-to-end distance. */
+
+/* Attempted pivots to discard while the initial rod equilibrates, as a
+ * multiple of the walk length. */
+#define PIVOT_BURN_IN 20
+/* Expected accepted pivots between successive samples.  The interval
+ * is converted to a fixed number of attempts after the burn-in, because
+ * sampling only after accepted moves would favour walks that accept
+ * moves easily. */
+#define PIVOT_SAMPLE_INTERVAL 10
+
+typedef struct _PivotWalk PivotWalk;
+
+struct _PivotWalk
+{
+  int length;
+  gint32 *x, *y;         /* Sites, length + 1 of each */
+  gint32 *new_x, *new_y; /* Scratch space for trial sites */
+  SawSiteHash *hash;
+};
+
+/* The seven non-trivial symmetries of the square lattice, as rows of
+ * a 2x2 matrix. */
+static const int pivot_symmetries[7][4] = {
+  { 0, -1,  1,  0}, /* Rotate by 90 degrees */
+  {-1,  0,  0, -1}, /* Rotate by 180 degrees */
+  { 0,  1, -1,  0}, /* Rotate by 270 degrees */
+  { 1,  0,  0, -1}, /* Reflect in x axis */
+  {-1,  0,  0,  1}, /* Reflect in y axis */
+  { 0,  1,  1,  0}, /* Reflect in y = x */
+  { 0, -1, -1,  0}, /* Reflect in y = -x */
+};
+
+static PivotWalk *
+pivot_walk_new (int length)
+{
+  PivotWalk *walk = g_new0 (PivotWalk, 1);
+  walk->length = length;
+  walk->x = g_new (gint32, length + 1);
+  walk->y = g_new (gint32, length + 1);
+  walk->new_x = g_new (gint32, length + 1);
+  walk->new_y = g_new (gint32, length + 1);
+  walk->hash = saw_site_hash_new (length + 1);
+
+  for (int i = 0; i <= length; i++) {
+    walk->x[i] = i;
+    walk->y[i] = 0;
+    saw_site_hash_insert (walk->hash, i, 0, i);
+  }
+  return walk;
+}
+
+static void
+pivot_walk_free (PivotWalk *walk)
+{
+  if (walk == NULL) return;
+  g_free (walk->x);
+  g_free (walk->y);
+  g_free (walk->new_x);
+  g_free (walk->new_y);
+  saw_site_hash_free (walk->hash);
+  g_free (walk);
+}
+
+/* Attempt a single pivot move.  Returns non-zero if it was accepted. */
+static int
+pivot_walk_attempt (PivotWalk *walk, gsl_rng *rng)
+{
+  int n = walk->length;
+  if (n < 2) return 0;
+
+  int k = 1 + gsl_rng_uniform_int (rng, n - 1);
+  const int *g = pivot_symmetries[gsl_rng_uniform_int (rng, 7)];
+
+  /* Move whichever side of the pivot is shorter. */
+  int dir = (2 * k >= n) ? 1 : -1;
+  int count = (dir > 0) ? n - k : k;
+  gint32 px = walk->x[k], py = walk->y[k];
+
+  /* Work outwards from the pivot, where collisions are most likely. */
+  for (int j = 1; j <= count; j++) {
+    int idx = k + dir * j;
+    gint32 rx = walk->x[idx] - px, ry = walk->y[idx] - py;
+    gint32 nx = px + g[0] * rx + g[1] * ry;
+    gint32 ny = py + g[2] * rx + g[3] * ry;
+
+    gint32 hit = saw_site_hash_lookup (walk->hash, nx, ny);
+    if (hit >= 0 && (hit - k) * dir <= 0) return 0;
+
+    walk->new_x[j] = nx;
+    walk->new_y[j] = ny;
+  }
+
+  /* Accepted; update the hash and the walk. */
+  for (int j = 1; j <= count; j++) {
+    int idx = k + dir * j;
+    saw_site_hash_remove (walk->hash, walk->x[idx], walk->y[idx]);
+  }
+  for (int j = 1; j <= count; j++) {
+    int idx = k + dir * j;
+    walk->x[idx] = walk->new_x[j];
+    walk->y[idx] = walk->new_y[j];
+    saw_site_hash_insert (walk->hash, walk->x[idx], walk->y[idx], idx);
+  }
+  return 1;
+}
+
+/* Generate num_walks samples of length-step self-avoiding walks and
+ * output their end-to-end distances.  Returns 0 on output failure. */
+int
+pivot_generate (gsl_rng *rng, int length, int num_walks, SawOutput *out)
+{
+  g_assert (rng);
+  g_assert (length > 0);
+  g_assert (out);
+
+  PivotWalk *walk = pivot_walk_new (length);
+  int status = 1;
+
+  long burn_in = (long) PIVOT_BURN_IN * length;
+  long accepted = 0;
+  for (long i = 0; i < burn_in; i++) {
+    accepted += pivot_walk_attempt (walk, rng);
+  }
+  long interval = PIVOT_SAMPLE_INTERVAL * burn_in / MAX (accepted, 1);
+
+  for (int i = 0; i < num_walks && !saw_shutdown_requested (); i++) {
+    for (long j = 0; j < interval; j++) {
+      pivot_walk_attempt (walk, rng);
+    }
+
+    double dx = walk->x[length] - walk->x[0];
+    double dy = walk->y[length] - walk->y[0];
+    status = saw_output_record (out, length, dx, dy, 1);
+    if (!status) break;
+  }
+
+  pivot_walk_free (walk);
+  return status;
+}
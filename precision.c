@@ -0,0 +1,190 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <math.h>
+
+#include <tiffio.h>
+
+#include "ridge-saw.h"
+
+/* Precision of image data handed to ridgetool.
+ *
+ * Images are normally written as 32-bit floating point TIFF files.
+ * Ridge detection only needs about 12 bits of precision, so images can
+ * instead be written as 16-bit unsigned integers, linearly scaled so
+ * that each image's minimum and maximum map to 0 and 65535.  Ridge
+ * positions don't depend on the offset or scale of the intensity, so
+ * this halves the size of the file that is written and read back for
+ * every tile, with little effect on the lines detected.  The effect can
+ * be checked by comparing line statistics for the same images at both
+ * precisions. */
+
+/* Parse a precision name.  Returns 0 if the name is unknown. */
+int
+saw_precision_parse (const char *name, SawPrecision *precision)
+{
+  if (strcmp (name, "float32") == 0) {
+    *precision = SAW_PRECISION_FLOAT32;
+  } else if (strcmp (name, "int16") == 0) {
+    *precision = SAW_PRECISION_INT16;
+  } else {
+    return 0;
+  }
+  return 1;
+}
+
+const char *
+saw_precision_name (SawPrecision precision)
+{
+  return (precision == SAW_PRECISION_INT16) ? "int16" : "float32";
+}
+
+/* Bytes per pixel of image data written at a precision. */
+gsize
+saw_precision_pixel_size (SawPrecision precision)
+{
+  return (precision == SAW_PRECISION_INT16) ? sizeof (guint16) : sizeof (float);
+}
+
+/* Rescale an image to the range of its finite pixels and write it as
+ * 16-bit integers.  Non-finite pixels, such as NaN nodata values in
+ * input files, are written as 0. */
+static int
+saw_surface_to_tiff_int16 (RutSurface *img, const char *filename)
+{
+  /* Find the range of the data */
+  float min = INFINITY, max = -INFINITY;
+  for (int i = 0; i < img->rows; i++) {
+    const float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      if (!isfinite (row[j])) continue;
+      min = MIN (min, row[j]);
+      max = MAX (max, row[j]);
+    }
+  }
+  if (!(max >= min)) min = max = 0; /* No finite pixels */
+  float scale = (max > min) ? G_MAXUINT16 / (max - min) : 0;
+
+  TIFF *tif = TIFFOpen (filename, "w");
+  if (tif == NULL) return 0;
+  TIFFSetField (tif, TIFFTAG_IMAGEWIDTH, (guint32) img->cols);
+  TIFFSetField (tif, TIFFTAG_IMAGELENGTH, (guint32) img->rows);
+  TIFFSetField (tif, TIFFTAG_BITSPERSAMPLE, 16);
+  TIFFSetField (tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+  TIFFSetField (tif, TIFFTAG_SAMPLEFORMAT, SAMPLEFORMAT_UINT);
+  TIFFSetField (tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_MINISBLACK);
+  TIFFSetField (tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+  TIFFSetField (tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+  TIFFSetField (tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize (tif, 0));
+
+  guint16 *buf = g_new (guint16, img->cols);
+  int status = 1;
+  for (int i = 0; status && i < img->rows; i++) {
+    const float *row = &RUT_SURFACE_REF (img, i, 0);
+    for (int j = 0; j < img->cols; j++) {
+      if (!isfinite (row[j])) {
+        buf[j] = 0;
+        continue;
+      }
+      float v = (row[j] - min) * scale + 0.5f;
+      buf[j] = (guint16) CLAMP (v, 0, G_MAXUINT16);
+    }
+    status = (TIFFWriteScanline (tif, buf, i, 0) >= 0);
+  }
+  g_free (buf);
+  TIFFClose (tif);
+  return status;
+}
+
+/* Write an image to a TIFF file at the given precision.  Returns 0 on
+ * failure. */
+int
+saw_surface_to_tiff (RutSurface *img, const char *filename,
+                     SawPrecision precision)
+{
+  if (precision == SAW_PRECISION_INT16) {
+    return saw_surface_to_tiff_int16 (img, filename);
+  }
+  return rut_surface_to_tiff (img, filename);
+}
+
+/* ---------------------------------------------------------------- */
+/* Validation */
+
+/* Add the lines detected in one image to a summary. */
+void
+saw_line_summary_add (SawLineSummary *summary, const SawLines *lines)
+{
+  summary->num_images++;
+  summary->num_lines += lines->num_lines;
+  for (guint i = 0; i < lines->num_lines; i++) {
+    const gint32 *start = &lines->points[2 * lines->offsets[i]];
+    const gint32 *end = &lines->points[2 * (lines->offsets[i+1] - 1)];
+    double dx = end[1] - start[1];
+    double dy = end[0] - start[0];
+    summary->sum_steps += lines->offsets[i+1] - lines->offsets[i] - 1;
+    summary->sum_r2 += dx*dx + dy*dy;
+  }
+}
+
+/* Add one summary to another. */
+void
+saw_line_summary_merge (SawLineSummary *summary, const SawLineSummary *other)
+{
+  summary->num_images += other->num_images;
+  summary->num_lines += other->num_lines;
+  summary->sum_steps += other->sum_steps;
+  summary->sum_r2 += other->sum_r2;
+}
+
+static void
+saw_line_summary_print (const char *name, const SawLineSummary *s,
+                        const SawLineSummary *ref, FILE *fp)
+{
+  double lines = (double) s->num_lines / MAX (s->num_images, 1);
+  double steps = s->sum_steps / MAX (s->num_lines, 1);
+  double r2 = s->sum_r2 / MAX (s->num_lines, 1);
+  fprintf (fp, "  %-8s %12.2f %12.3f %14.3f", name, lines, steps, r2);
+
+  if (ref != NULL) {
+    double ref_lines = (double) ref->num_lines / MAX (ref->num_images, 1);
+    double ref_steps = ref->sum_steps / MAX (ref->num_lines, 1);
+    double ref_r2 = ref->sum_r2 / MAX (ref->num_lines, 1);
+    fprintf (fp, "   (%+.2f%%, %+.2f%%, %+.2f%%)",
+             100 * (lines / ref_lines - 1), 100 * (steps / ref_steps - 1),
+             100 * (r2 / ref_r2 - 1));
+  }
+  fprintf (fp, "\n");
+}
+
+/* Report how line statistics at reduced precision differ from those
+ * at full precision. */
+void
+saw_precision_report (SawPrecision precision, const SawLineSummary *ref,
+                      const SawLineSummary *test, FILE *fp)
+{
+  fprintf (fp, "Precision validation over %" G_GUINT64_FORMAT " images:\n"
+           "  %-8s %12s %12s %14s\n", ref->num_images,
+           "", "lines/image", "mean steps", "mean sq dist");
+  saw_line_summary_print (saw_precision_name (SAW_PRECISION_FLOAT32), ref,
+                          NULL, fp);
+  saw_line_summary_print (saw_precision_name (precision), test, ref, fp);
+}
@@ -19,96 +19,523 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include <ctype.h>
+#include <getopt.h>
+#ifdef HAVE_POSIX_SPAWN
+#  include <spawn.h>
+#endif
 
 #include <glib.h>
-#include <gsl/gsl_randist.h>
 
-#define GETOPT_OPTIONS "i:r::d:t:n:s:h"
+#define GETOPT_OPTIONS "i:r::d:t:n:s:l:j:ab:z:pw:h"
+
+/* Options with no short form */
+enum {
+  OPTION_REPLAY_TILE = 256,
+  OPTION_DUMP,
+  OPTION_AUTOTUNE,
+  OPTION_HUGE_PAGES,
+  OPTION_NO_NUMA,
+  OPTION_PRECISION,
+  OPTION_VALIDATE_PRECISION,
+  OPTION_RESERVE,
+  OPTION_MEM_LIMIT,
+  OPTION_SAMPLE_LINES,
+  OPTION_SAMPLE_SIZE,
+  OPTION_BOOTSTRAP,
+  OPTION_BOOTSTRAP_REPLICATES,
+  OPTION_HISTOGRAM,
+  OPTION_HISTOGRAM_NU,
+  OPTION_COMPONENTS,
+};
+
+static const struct option long_options[] = {
+  {"replay-tile", required_argument, NULL, OPTION_REPLAY_TILE},
+  {"dump", required_argument, NULL, OPTION_DUMP},
+  {"autotune", no_argument, NULL, OPTION_AUTOTUNE},
+  {"huge-pages", required_argument, NULL, OPTION_HUGE_PAGES},
+  {"no-numa", no_argument, NULL, OPTION_NO_NUMA},
+  {"precision", required_argument, NULL, OPTION_PRECISION},
+  {"validate-precision", no_argument, NULL, OPTION_VALIDATE_PRECISION},
+  {"reserve", required_argument, NULL, OPTION_RESERVE},
+  {"mem-limit", required_argument, NULL, OPTION_MEM_LIMIT},
+  {"sample-lines", required_argument, NULL, OPTION_SAMPLE_LINES},
+  {"sample-size", required_argument, NULL, OPTION_SAMPLE_SIZE},
+  {"bootstrap", required_argument, NULL, OPTION_BOOTSTRAP},
+  {"bootstrap-replicates", required_argument, NULL,
+   OPTION_BOOTSTRAP_REPLICATES},
+  {"histogram", required_argument, NULL, OPTION_HISTOGRAM},
+  {"histogram-nu", required_argument, NULL, OPTION_HISTOGRAM_NU},
+  {"components", no_argument, NULL, OPTION_COMPONENTS},
+  {"help", no_argument, NULL, 'h'},
+  {NULL, 0, NULL, 0},
+};
 
 #include <ridgeutil.h>
 #include <ridgeio.h>
 
+#include "ridge-saw.h"
+
 enum GenerateMode {
-  GENERATE_SPECKLE = 0,
-  GENERATE_NORM,
+  GENERATE_NOISE = 0,
+  GENERATE_SAW_PIVOT,
+  GENERATE_SAW_PERM,
+  GENERATE_SAW_EXACT,
 };
 
 void
 usage (char *name, int status)
 {
   printf (
-"Usage: %s OPTION... [FILE]\n"
+"Usage: %s OPTION... [OUTFILE]\n"
 "\n"
 "Generate ridge data for self-avoiding walk analysis.\n"
 "\n"
 "  -r [TYPE]       Generate random image data [default: S]\n"
-"  -d SIZE         Size for random tiles [default: 2048]\n"
+"  -d SIZE         Size for random or input tiles [default: 2048]\n"
+"  -w OVERLAP      Process FILE in tiles overlapping by OVERLAP pixels\n"
 "  -t SCALE        Ridge detection scale [default: 0]\n"
 "  -n NUM          Target data point count for random generation\n"
 "  -s SEED         Random seed.\n"
-"  -h              Display this message and exit\n"
-"\n"
+"  --replay-tile K Regenerate and process only random tile K\n"
+"  --dump PREFIX   Save the replayed tile's image data and lines\n"
+"  --autotune      Choose the random tile size for best throughput\n"
+"  -l LENGTH       Step count for reference walks [default: 1000, or\n"
+"                  20 for exact enumeration]\n"
+"  -j THREADS      Number of worker threads [default: available\n"
+"                  processors, less any reserved]\n"
+"  --reserve NUM   Processors to leave free for output and ridgetool\n"
+"                  when choosing the default THREADS [default: 0]\n"
+"  -a              Output aggregate statistics per step count\n"
+"  --components    Also output end-to-end displacement components\n"
+"  --sample-lines SAMPLEFILE\n"
+"                  Save a random sample of complete lines\n"
+"  --sample-size K Lines to sample per length bin [default: 100]\n"
+"  --bootstrap BOOTFILE\n"
+"                  Save <R^2> and nu with bootstrap confidence intervals\n"
+"  --bootstrap-replicates B\n"
+"                  Bootstrap replicates [default: 1000]\n"
+"  --histogram HISTFILE\n"
+"                  Save a histogram of step count and scaled distance\n"
+"  --histogram-nu NU\n"
+"                  Exponent for scaling distances [default: 0.75]\n"
+"  -b KIB          Output buffer size, or 0 to write synchronously\n"
+"                  [default: 1024]\n"
+"  -z FORMAT       Compress output with FORMAT (none, gzip or zstd)\n"
+"  -p              Stream line data from ridgetool through a pipe\n"
+"  --huge-pages MODE\n"
+"                  Huge pages for image buffers: off, thp or explicit\n"
+"                  [default: thp]\n"
+"  --no-numa       Don't bind tile workers to NUMA nodes\n"
+"  --mem-limit SIZE\n"
+"                  Limit memory use by tiles to SIZE MiB, or use a\n"
+"                  K, M, G or T suffix\n"
+"  --precision MODE\n"
+"                  Image data precision passed to ridgetool: float32\n"
+"                  or int16 [default: float32]\n"
+"  --validate-precision\n"
+"                  Compare random tile results against float32\n"
+"  -h, --help      Display this message and exit\n"
+"\n",
+name);
+  printf (
 "Detect ridge lines and output step count and end-to-end distance for\n"
 "comparison with self-avoiding walk statistics.  Two modes are\n"
 "available:\n"
 "\n"
 "  - If a FILE was specified, image data is loaded from FILE, and\n"
-"    the number of data points is determined automatically.\n"
+"    the number of data points is determined automatically.  If the\n"
+"    '-w' option is given, FILE is read and processed in tiles of SIZE\n"
+"    pixels, each extended by OVERLAP pixels on every side, so that\n"
+"    images too large to fit in memory can be used.  Lines that cross\n"
+"    the seams between tiles are joined up.  The overlap should be\n"
+"    several times larger than the detection scale.\n"
 "\n"
 "  - If the '-r' option was given, random noise images are generated\n"
 "    and used to obtain line data.  The '-r' option controls the\n"
-"    noise function used; the TYPE must be 'S' (default) or 'N'.  The\n"
-"    '-d' option controls how large the generated images are.  If the\n"
-"    '-n' option is given, images will be repeatedly generated until\n"
-"    NUM data points have been created.  The '-s' option allows the\n"
-"    random number generator seed to be overridden.\n"
+"    noise function used (see below).  The '-d' option controls how\n"
+"    large the generated images are.  If the '-n' option is given,\n"
+"    images will be repeatedly generated until NUM data points have\n"
+"    been created.  The '-s' option allows the random number\n"
+"    generator seed to be overridden.  Images are generated and\n"
+"    processed by THREADS workers at once, so up to THREADS - 1 more\n"
+"    images than necessary may be processed.\n"
+"\n"
+"    Each random image, or tile, is generated from its own seed,\n"
+"    derived from the random seed and the tile's index, and records\n"
+"    include the tile index as an extra field, in the format\n"
+"    \"num_steps, distance, tile\".  Tile seeds have 32 bits, so a run\n"
+"    of around 10^5 or more tiles is likely to repeat a few tiles.\n"
+"    Given the same '-r', '-d' and '-s' options, '--replay-tile'\n"
+"    regenerates a single tile, for example to investigate an\n"
+"    outlier.  With '--dump', the tile's image data is saved to\n"
+"    PREFIX.tif and its lines to PREFIX-lines.csv, in the format\n"
+"    \"line, row, col\".\n"
+"\n"
+"    With '--autotune', a few calibration tiles are generated at a\n"
+"    range of sizes, and the size that yields the most lines per\n"
+"    second that don't touch the edge of the tile is used instead of\n"
+"    SIZE.  Whether to use '-p' is chosen in the same way.  The\n"
+"    choice is recorded in a \"#\" comment line at the start of the\n"
+"    output.\n"
+"\n"
+"    With '--validate-precision', each tile is processed both at\n"
+"    the precision given by '--precision' and at float32, and a\n"
+"    comparison of the line counts, mean step counts and mean square\n"
+"    distances is printed to standard error at exit.  Records are\n"
+"    output at the selected precision.\n"
+"\n"
+"The noise TYPE may be followed by a colon and a parameter, and must\n"
+"be one of:\n"
+"\n");
+  noise_print_types (stdout);
+  printf (
+"\n"
+"Reference data for true self-avoiding walks on the square lattice\n"
+"can be generated in the same output format by giving '-r W'.  Walks\n"
+"of LENGTH steps are sampled with the pivot algorithm, and NUM walks\n"
+"are output.  Alternatively, '-r P' grows walks of up to LENGTH steps\n"
+"with the pruned-enriched Rosenbluth method, running NUM independent\n"
+"tours in parallel.  Every walk grown is output with its statistical\n"
+"weight as an extra field, in the format \"num_steps, distance,\n"
+"weight\".  Weights are divided by 2.638^num_steps, so that they stay\n"
+"in range for long walks; only weights of walks with the same number\n"
+"of steps should be compared.\n"
+"\n"
+"Exact statistics for all walks of up to LENGTH steps can be obtained\n"
+"with '-r X'.  Output is always in the aggregate format (see below),\n"
+"where the weight is the number of walks.  Results are cached, so the\n"
+"enumeration is only carried out once for each LENGTH.  LENGTH may be\n"
+"at most %i.\n"
+"\n"
+"If the '-a' option is given, the mean square end-to-end distance is\n"
+"output for each step count instead of individual records, in the\n"
+"format \"num_steps, mean_sq_distance, weight\", where the weight is\n"
+"the total weight of the records for that step count.\n"
+"\n"
+"With '--components', individual records have two more fields, \"dx,\n"
+"dy\", giving the end-to-end displacement along image rows and down\n"
+"image columns (or along the lattice axes).  Aggregate statistics\n"
+"have three more, \"mean_dx2, mean_dy2, mean_dxdy\", so that\n"
+"anisotropy can be detected.\n"
+"\n",
+ENUM_MAX_LENGTH);
+  printf (
+"By default, one worker thread is used for each processor that\n"
+"ridge-saw may run on, as limited by its CPU affinity and by any\n"
+"cgroup v2 CPU quota (for example, in a container), less the number\n"
+"given by '--reserve'.\n"
+"\n"
+"In the '-r' and '-w' modes, each worker thread has its own queue of\n"
+"tiles, and takes tiles from other workers' queues when its own runs\n"
+"out.  The time each worker spent busy and idle is reported at exit.\n"
+"\n"
+"With '--mem-limit', ridge-saw keeps track of the memory used by\n"
+"image buffers, line data and output buffers.  In the '-r' and '-w'\n"
+"modes, a worker waits before starting a tile if there isn't room for\n"
+"it within SIZE, and in the '-r' mode fewer workers are started if\n"
+"their buffers don't all fit.  The peak memory accounted for, the\n"
+"peak resident set size of ridge-saw and of the largest ridgetool\n"
+"process, and the time spent waiting are reported at exit.\n"
+"\n"
+"With '--sample-lines', a uniform random sample of at most K complete\n"
+"lines is kept for each range of step counts from 2^b to 2^(b+1) - 1,\n"
+"however many lines are detected, and written to SAMPLEFILE at exit\n"
+"in the format \"bin, line, tile, row, col\", with one row per point.\n"
+"Each bin is preceded by a \"#\" comment giving the number of lines\n"
+"seen in it.  The sample depends on the '-s' seed, but not on the\n"
+"number of threads.  This is available with '-r', or with '-i'\n"
+"without '-w'.\n"
+"\n"
+"With '--bootstrap', only partial sums per tile are kept, binned by\n"
+"step count from 2^b to 2^(b+1) - 1, and at exit B bootstrap\n"
+"replicates resampling whole tiles are run on THREADS threads, so\n"
+"that correlations between lines from the same tile are allowed for.\n"
+"The mean square distance for each bin and the exponent nu, fitted\n"
+"to the bins with at least 10 lines, are written to BOOTFILE with 95%%\n"
+"intervals.  This is only available with '-r'.\n"
+"\n");
+  printf (
+"With '--histogram', the distribution of end-to-end distance R is\n"
+"accumulated for ranges of step count N of a quarter of an octave,\n"
+"in 80 bins of R/N^NU from 0 to 4 and one bin for larger values, and\n"
+"written to HISTFILE at exit, one row per range, in the format\n"
+"\"min_steps, mean_steps, weight, count...\".  Each thread keeps its\n"
+"own histogram, so the cost per record is small and the memory used\n"
+"is fixed.  This is not available with '-r X'.\n"
+"\n"
+"Individual records are formatted by the threads that produce them,\n"
+"and written out by a separate thread, so that generation isn't held\n"
+"up by slow output.  If more than the buffer size given by '-b' is\n"
+"waiting to be written, generation pauses, and the total time spent\n"
+"waiting is reported at exit.\n"
 "\n"
 "If an OUTFILE was specified, CSV data is output to that file;\n"
-"otherwise, output is to standard output.\n"
+"otherwise, output is to standard output.  If OUTFILE ends in '.gz'\n"
+"or '.zst', or the '-z' option is given, output is compressed in\n"
+"blocks by THREADS threads, and the compressed blocks are written as\n"
+"consecutive gzip members or zstd frames, which can be read back with\n"
+"the usual tools.\n"
+"\n"
+"If ridge-saw receives SIGINT, SIGTERM or SIGHUP, it stops starting\n"
+"new images, tiles or walks, finishes the ones in progress, and then\n"
+"writes out all results so far, including aggregate statistics, and\n"
+"exits.  Lines that may continue into unprocessed tiles are dropped.\n"
+"A second signal aborts immediately.\n"
+"\n"
+"Image data is passed to ridgetool as 32-bit floating point TIFF\n"
+"files.  With '--precision int16', each image or tile is instead\n"
+"rescaled to its own range and written as 16-bit integers, halving\n"
+"the data written and read back for every tile.  Pixels that aren't\n"
+"finite numbers, such as NaN nodata values, are written as 0.\n"
+"\n"
+"If the '-p' option is given, ridgetool writes line data to a named\n"
+"pipe, and the data is parsed while ridgetool is still running,\n"
+"instead of being written to a temporary file and loaded afterwards.\n"
 "\n"
 "The RIDGETOOL environment variable can be set to control the path to\n"
 "the 'ridgetool' program.\n"
 "\n"
+"Lines detected in input files are cached, so that processing the same\n"
+"image again at the same scale is fast.  Tiles processed with '-w'\n"
+"are not cached.  The RIDGE_SAW_CACHE_SIZE environment variable sets\n"
+"the maximum size of the cache in MiB [default: 1024]; set it to 0 to\n"
+"disable the cache.\n"
+"\n"
 "Please report bugs to %s.\n",
-name, PACKAGE_BUGREPORT);
+PACKAGE_BUGREPORT);
   exit (status);
 }
 
-RioData *
-run_ridgetool_get_data (const char *filename, float scale)
+/* Figure out how to call ridgetool */
+const gchar *
+get_ridgetool_path (void)
 {
-  g_assert (filename);
-
-  /* Figure out how to call ridgetool */
   const gchar *ridgetool_path = g_getenv ("RIDGETOOL");
   if (ridgetool_path == NULL) ridgetool_path = "ridgetool";
+  return ridgetool_path;
+}
+
+/* Whether to stream line data from ridgetool through a pipe */
+static int ridgetool_stream = 0;
 
-  /* Get a temporary filename. FIXME we don't use this in a secure
-   * way, unfortunately. */
-  gchar *tmpfile = g_strdup ("ridge-saw.XXXXXX");
-  int tmpfd = mkstemp (tmpfile);
-  if (tmpfd == -1) {
+int
+get_ridgetool_stream (void)
+{
+  return ridgetool_stream;
+}
+
+void
+set_ridgetool_stream (int stream)
+{
+  ridgetool_stream = stream;
+}
+
+/* Line data being streamed from ridgetool through a named pipe (see
+ * run_ridgetool_stream()). */
+typedef struct _RidgetoolParse RidgetoolParse;
+
+struct _RidgetoolParse
+{
+  gchar *dir;
+  gchar *filename;
+  int hold_fd;
+  GThread *thread;
+  RioData *data;
+  int error;
+  volatile gint done;
+  GMutex mutex;
+  pid_t pid;     /* ridgetool, while it's running, or 0 */
+};
+
+/* Stop ridgetool if the parser has given up.  The parser's copy of
+ * the read end of the pipe may have been inherited by ridgetool or by
+ * another worker's ridgetool, so ridgetool can't rely on getting
+ * EPIPE.  Must be called with the mutex held. */
+static void
+ridgetool_stream_kill (RidgetoolParse *parse)
+{
+  if (parse->pid > 0 && parse->done && parse->data == NULL) {
+    kill (-parse->pid, SIGTERM);
+  }
+}
+
+static gpointer
+ridgetool_parse_thread (gpointer user_data)
+{
+  RidgetoolParse *parse = (RidgetoolParse *) user_data;
+  errno = 0;
+  RioData *data = rio_data_from_file (parse->filename);
+  int error = errno;
+
+  g_mutex_lock (&parse->mutex);
+  parse->data = data;
+  parse->error = error;
+  g_atomic_int_set (&parse->done, 1);
+  ridgetool_stream_kill (parse);
+  g_mutex_unlock (&parse->mutex);
+  return NULL;
+}
+
+/* Record that ridgetool is running as pid, or has finished if pid is
+ * 0. */
+static void
+ridgetool_stream_set_pid (RidgetoolParse *parse, pid_t pid)
+{
+  if (parse == NULL) return;
+  g_mutex_lock (&parse->mutex);
+  parse->pid = pid;
+  ridgetool_stream_kill (parse);
+  g_mutex_unlock (&parse->mutex);
+}
+
+/* Release the pipe, wait for the parser, and remove the pipe and its
+ * directory.  ridgetool must not be running. */
+static void
+ridgetool_stream_cleanup (RidgetoolParse *parse)
+{
+  if (parse->hold_fd != -1) close (parse->hold_fd);
+  parse->hold_fd = -1;
+  if (parse->thread != NULL) g_thread_join (parse->thread);
+  parse->thread = NULL;
+  unlink (parse->filename);
+  rmdir (parse->dir);
+}
+
+/* Report that the parser failed, and exit. */
+static void
+ridgetool_stream_parse_failed (RidgetoolParse *parse)
+{
+  ridgetool_stream_cleanup (parse);
+  const char *msg = parse->error ? strerror (parse->error) : "Unexpected error";
+  fprintf (stderr, "ERROR: Failed to load ridge data from '%s': %s\n\n",
+           parse->filename, msg);
+  exit (2);
+}
+
+/* Called when ridgetool couldn't be run or failed, before the failure
+ * is reported.  If the parser had already given up while ridgetool
+ * was still running, ridgetool most likely failed writing to the pipe,
+ * so the parser's error is the one to report. */
+static void
+ridgetool_stream_abort (RidgetoolParse *parse)
+{
+  if (parse == NULL) return;
+  if (g_atomic_int_get (&parse->done) && parse->data == NULL) {
+    ridgetool_stream_parse_failed (parse);
+  }
+  ridgetool_stream_cleanup (parse);
+}
+
+#ifdef HAVE_POSIX_SPAWN
+
+/* Run ridgetool to completion, exiting on failure.  If line data is
+ * being streamed, stream is the parser.
+ *
+ * The child is started with posix_spawn(), which avoids copying the
+ * parent's page tables, so launching stays cheap however much memory
+ * ridge-saw is using, and is safe to do from several threads at once.
+ * Its standard error goes to a temporary file, which is only read if
+ * ridgetool fails.  It runs in its own process group, so that it isn't
+ * interrupted by a SIGINT from the terminal (see shutdown.c). */
+static void
+spawn_ridgetool (const gchar **argv, RidgetoolParse *stream)
+{
+  SawTempFile *err_tmp = saw_temp_file_new ();
+  if (err_tmp == NULL) {
     const char *msg = errno ? strerror (errno) : "Unexpected error";
     fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
              msg);
-    exit (2);
+    exit (5);
   }
 
-  /* Format scale as string */
-  gchar *sscale = g_strdup_printf ("-t%f", scale);
+  posix_spawn_file_actions_t actions;
+  posix_spawn_file_actions_init (&actions);
+  posix_spawn_file_actions_adddup2 (&actions, err_tmp->fd, STDERR_FILENO);
 
-  /* Invoke ridgetool */
-  const gchar *argv[] = {ridgetool_path,
-                         "-l",
-                         sscale,
-                         "-i0",
-                         filename,
-                         tmpfile,
-                         NULL};
+  posix_spawnattr_t attr;
+  sigset_t mask;
+  sigemptyset (&mask);
+  posix_spawnattr_init (&attr);
+  posix_spawnattr_setsigmask (&attr, &mask);
+  posix_spawnattr_setpgroup (&attr, 0);
+  posix_spawnattr_setflags (&attr, POSIX_SPAWN_SETSIGMASK
+                            | POSIX_SPAWN_SETPGROUP);
+
+  pid_t pid;
+  int err = posix_spawnp (&pid, argv[0], &actions, &attr,
+                          (char * const *) argv, environ);
+  posix_spawn_file_actions_destroy (&actions);
+  posix_spawnattr_destroy (&attr);
+  if (err != 0) {
+    ridgetool_stream_abort (stream);
+    fprintf (stderr, "ERROR: Failed to run '%s': %s\n\n",
+             argv[0], strerror (err));
+    exit (3);
+  }
+  saw_shutdown_add_child (pid);
+  ridgetool_stream_set_pid (stream, pid);
+
+  int status;
+  while (waitpid (pid, &status, 0) == -1) {
+    if (errno == EINTR) continue;
+    fprintf (stderr, "ERROR: Failed to wait for '%s': %s\n\n",
+             argv[0], strerror (errno));
+    exit (3);
+  }
+  ridgetool_stream_set_pid (stream, 0);
+  saw_shutdown_remove_child (pid);
+
+  if (!WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    ridgetool_stream_abort (stream);
+    struct stat st;
+    gchar *err_output = NULL;
+    if (fstat (err_tmp->fd, &st) == 0) {
+      err_output = g_malloc0 (st.st_size + 1);
+      if (pread (err_tmp->fd, err_output, st.st_size, 0) < 0) {
+        err_output[0] = '\0';
+      }
+    }
+    if (WIFSIGNALED (status)) {
+      fprintf (stderr, "ERROR: '%s' killed by signal %i:\n%s\n\n",
+               argv[0], WTERMSIG (status), err_output ? err_output : "");
+    } else {
+      fprintf (stderr, "ERROR: '%s' failed:\n%s\n\n",
+               argv[0], err_output ? err_output : "");
+    }
+    exit (3);
+  }
+
+  saw_temp_file_free (err_tmp);
+}
+
+#else /* !HAVE_POSIX_SPAWN */
+
+/* Put ridgetool in its own process group, and unblock the signals that
+ * ridge-saw handles in its signal thread (see shutdown.c). */
+static void
+ridgetool_child_setup (gpointer user_data)
+{
+  sigset_t mask;
+  sigemptyset (&mask);
+  setpgid (0, 0);
+  sigprocmask (SIG_SETMASK, &mask, NULL);
+}
+
+/* Run ridgetool to completion, exiting on failure.  If line data is
+ * being streamed, stream is the parser.  g_spawn_sync() closes all
+ * other descriptors in the child, so ridgetool gets EPIPE if the
+ * parser gives up. */
+static void
+spawn_ridgetool (const gchar **argv, RidgetoolParse *stream)
+{
   gint exit_status;
   gchar *err_output = NULL;
   GError *err = NULL;
@@ -116,70 +543,431 @@ run_ridgetool_get_data (const char *filename, float scale)
                 (gchar **) argv,
                 NULL /* envp */,
                 G_SPAWN_SEARCH_PATH /* flags */,
-                NULL /* child setup */,
+                ridgetool_child_setup /* child setup */,
                 NULL /* child setup data */,
                 NULL /* standard output */,
                 &err_output /* standard error */,
                 &exit_status,
                 &err);
   if (err != NULL) {
+    ridgetool_stream_abort (stream);
     fprintf (stderr, "ERROR: Failed to run '%s': %s\n\n",
-             ridgetool_path, err->message);
+             argv[0], err->message);
     exit (3);
   }
   if (exit_status != 0) {
+    ridgetool_stream_abort (stream);
     fprintf (stderr, "ERROR: '%s' failed:\n%s\n\n",
-             ridgetool_path, err_output);
+             argv[0], err_output);
     exit(3);
   }
-  g_free (sscale);
+  g_free (err_output);
+}
+
+#endif /* !HAVE_POSIX_SPAWN */
 
-  /* Load ridge data */
-  RioData *data = rio_data_from_file (tmpfile);
-  if (data == NULL) {
+/* Run ridgetool with its line data output going to a named pipe,
+ * which is parsed by another thread while ridgetool is still running.
+ * Once the parser has opened the pipe, ridge-saw holds it open for
+ * writing until ridgetool exits, so the parser can neither block
+ * forever waiting for a writer nor see end-of-file too early.
+ * ridge-saw never holds the read end, and if the parser gives up, it
+ * stops ridgetool, so ridgetool can't block forever on a full pipe. */
+static RioData *
+run_ridgetool_stream (const gchar **argv, int output_arg)
+{
+  GError *err = NULL;
+  RidgetoolParse parse;
+  memset (&parse, 0, sizeof (parse));
+  g_mutex_init (&parse.mutex);
+  parse.hold_fd = -1;
+  parse.dir = g_dir_make_tmp ("ridge-saw.XXXXXX", &err);
+  if (parse.dir == NULL) {
+    fprintf (stderr, "ERROR: Failed to create temporary directory: %s\n\n",
+             err->message);
+    exit (5);
+  }
+  parse.filename = g_build_filename (parse.dir, "lines", NULL);
+  if (mkfifo (parse.filename, 0600) != 0) {
     const char *msg = errno ? strerror (errno) : "Unexpected error";
-    fprintf (stderr, "ERROR: Failed to load ridge data from '%s': %s\n\n",
-             tmpfile, msg);
-    exit (2);
+    fprintf (stderr, "ERROR: Failed to create pipe '%s': %s\n\n",
+             parse.filename, msg);
+    ridgetool_stream_cleanup (&parse);
+    exit (5);
   }
 
-  /* Clean up */
-  close (tmpfd);
-  unlink (tmpfile);
-  g_free (tmpfile);
+  parse.thread = g_thread_new ("parse", ridgetool_parse_thread, &parse);
 
+  /* Opening the pipe write-only without blocking fails with ENXIO
+   * until the parser has opened it for reading. */
+  for (;;) {
+    parse.hold_fd = open (parse.filename, O_WRONLY | O_NONBLOCK | O_CLOEXEC);
+    if (parse.hold_fd != -1 || errno != ENXIO) break;
+    if (g_atomic_int_get (&parse.done)) ridgetool_stream_parse_failed (&parse);
+    g_usleep (1000);
+  }
+  if (parse.hold_fd == -1) {
+    const char *msg = errno ? strerror (errno) : "Unexpected error";
+    fprintf (stderr, "ERROR: Failed to open pipe '%s': %s\n\n",
+             parse.filename, msg);
+    /* The parser may still be waiting for a writer, so it can't be
+     * joined, but the pipe can still be removed. */
+    unlink (parse.filename);
+    rmdir (parse.dir);
+    exit (5);
+  }
+
+  argv[output_arg] = parse.filename;
+  spawn_ridgetool (argv, &parse);
+  ridgetool_stream_cleanup (&parse);
+  if (parse.data == NULL) ridgetool_stream_parse_failed (&parse);
+
+  g_mutex_clear (&parse.mutex);
+  g_free (parse.filename);
+  g_free (parse.dir);
+  return parse.data;
+}
+
+RioData *
+run_ridgetool_get_data (const char *filename, float scale)
+{
+  g_assert (filename);
+
+  /* Format scale as string */
+  gchar *sscale = g_strdup_printf ("-t%f", scale);
+
+  /* Invoke ridgetool */
+  const gchar *argv[] = {get_ridgetool_path (),
+                         "-l",
+                         sscale,
+                         "-i0",
+                         filename,
+                         NULL, /* Output file */
+                         NULL};
+  RioData *data;
+
+  if (ridgetool_stream) {
+    data = run_ridgetool_stream (argv, 5);
+
+  } else {
+    /* Get a temporary file for the line data */
+    SawTempFile *tmp = saw_temp_file_new ();
+    if (tmp == NULL) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
+               msg);
+      exit (2);
+    }
+    argv[5] = tmp->path;
+    spawn_ridgetool (argv, NULL);
+
+    /* Load ridge data */
+    data = rio_data_from_file (tmp->path);
+    if (data == NULL) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to load ridge data from '%s': %s\n\n",
+               tmp->path, msg);
+      exit (2);
+    }
+    saw_temp_file_free (tmp);
+  }
+
+  g_free (sscale);
   return data;
 }
 
+/* Detect lines in an image file, using cached results if the same
+ * image has been processed at the same scale before. */
+SawLines *
+detect_lines (const char *filename, float scale)
+{
+  guint64 key = 0;
+  if (saw_cache_enabled ()) {
+    key = saw_cache_key (filename, scale);
+    if (key != 0) {
+      SawLines *lines = saw_cache_lookup (key);
+      if (lines != NULL) return lines;
+    }
+  }
+
+  RioData *data = run_ridgetool_get_data (filename, scale);
+  SawLines *lines = saw_lines_from_rio_data (data);
+  rio_data_destroy (data);
+
+  if (key != 0) saw_cache_store (key, lines);
+  return lines;
+}
+
 int
-dump_saw_stats (RioData *data, FILE *fp)
+dump_saw_stats (SawLines *lines, int tile, SawOutput *out)
 {
-  g_assert (data);
-  g_assert (fp);
-  g_assert (rio_data_get_type (data) == RIO_DATA_LINES);
+  g_assert (lines);
+  g_assert (out);
+
+  if (out->sampler != NULL) saw_sampler_add (out->sampler, lines, tile);
+  if (out->bootstrap != NULL && tile >= 0) {
+    saw_bootstrap_add_tile (out->bootstrap, lines, tile);
+  }
 
-  for (int i = 0; i < rio_data_get_num_entries (data); i++) {
-    RioLine *l = rio_data_get_line (data, i);
-    int len = rio_line_get_length (l);
-    RioPoint *start = rio_line_get_point (l, 0);
-    RioPoint *end = rio_line_get_point (l, len - 1);
+  int status;
+  for (guint i = 0; i < lines->num_lines; i++) {
+    const gint32 *start = &lines->points[2 * lines->offsets[i]];
+    const gint32 *end = &lines->points[2 * (lines->offsets[i+1] - 1)];
+    int len = lines->offsets[i+1] - lines->offsets[i];
 
     /* Calculate distance */
-    double start_row, start_col, end_row, end_col;
-    rio_point_get_subpixel (start, &start_row, &start_col);
-    rio_point_get_subpixel (end, &end_row, &end_col);
-    double dx = floor (end_col) - floor (start_col);
-    double dy = floor (end_row) - floor (start_row);
-    double dist = sqrt (dx*dx + dy*dy);
-
-    /* Output is in the format "num_steps, distance" */
-    if (fprintf (fp, "%i, %f\n", len - 1, dist) < 0) {
-      return 0;
+    double dx = end[1] - start[1];
+    double dy = end[0] - start[0];
+
+    if (tile >= 0) {
+      status = saw_output_tile_record (out, tile, len - 1, dx, dy);
+    } else {
+      status = saw_output_record (out, len - 1, dx, dy, 1);
     }
+    if (!status) return 0;
   }
   return 1; /* Success */
 }
 
+/* Save a generated tile's image data to PREFIX.tif, and its lines to
+ * PREFIX-lines.csv in the format "line, row, col", for inspection. */
+static void
+dump_tile (const char *prefix, RutSurface *img, const SawLines *lines)
+{
+  gchar *filename = g_strconcat (prefix, ".tif", NULL);
+  if (!rut_surface_to_tiff (img, filename)) {
+    fprintf (stderr, "ERROR: Failed to write image data to '%s'.\n\n",
+             filename);
+    exit (4);
+  }
+  g_free (filename);
+
+  filename = g_strconcat (prefix, "-lines.csv", NULL);
+  FILE *fp = fopen (filename, "w");
+  int status = (fp != NULL);
+  for (guint i = 0; status && i < lines->num_lines; i++) {
+    for (guint32 k = lines->offsets[i]; status && k < lines->offsets[i+1];
+         k++) {
+      status = (fprintf (fp, "%u, %i, %i\n", i, lines->points[2*k],
+                         lines->points[2*k + 1]) >= 0);
+    }
+  }
+  if (fp != NULL && fclose (fp) != 0) status = 0;
+  if (!status) {
+    const char *msg = errno ? strerror (errno) : "Unexpected error";
+    fprintf (stderr, "ERROR: Failed to write lines to '%s': %s\n\n",
+             filename, msg);
+    exit (4);
+  }
+  g_free (filename);
+}
+
+/* Detect lines in an image, passing it to ridgetool through the file
+ * at path, with the given precision. */
+SawLines *
+detect_surface_lines (RutSurface *img, const char *path, float scale,
+                      SawPrecision precision)
+{
+  if (!saw_surface_to_tiff (img, path, precision)) {
+    fprintf (stderr, "ERROR: Failed to write image data to '%s'.\n\n",
+             path);
+    exit (5);
+  }
+
+  RioData *data = run_ridgetool_get_data (path, scale);
+  SawLines *lines = saw_lines_from_rio_data (data);
+  rio_data_destroy (data);
+  return lines;
+}
+
+gsl_rng *
+rng_new (int seed)
+{
+  gsl_rng_env_setup ();
+  gsl_rng *rng = gsl_rng_alloc (gsl_rng_default);
+  if (seed >= 0) {
+    gsl_rng_set (rng, (unsigned int) seed);
+  }
+  fprintf (stderr, "Random number seed: %lu (%s)\n",
+           (seed >= 0) ? seed : gsl_rng_default_seed,
+           gsl_rng_name (rng));
+  return rng;
+}
+
+/* Random image generation, shared between tile workers. */
+typedef struct _NoiseJob NoiseJob;
+typedef struct _NoiseWorker NoiseWorker;
+
+struct _NoiseWorker
+{
+  NoiseSource *noise;
+  gsl_rng *rng;
+  RutSurface *img;
+  SawTempFile *tmp;
+  SawLineSummary ref_summary, test_summary;
+};
+
+struct _NoiseJob
+{
+  int size;
+  const char *noise_spec;
+  const gsl_rng *rng;
+  unsigned long seed;
+  float scale;
+  SawPrecision precision;
+  int validate_precision;
+  const char *dump_prefix;
+  int target;
+  gboolean replay;
+  SawOutput *out;
+  NoiseWorker *workers;
+
+  volatile gint num_lines;
+  volatile gint num_tiles;
+  volatile gint next_tile;
+  volatile gint failed;
+  int error;
+};
+
+/* Allocate a worker's noise source, image and temporary file.  This
+ * is done by the worker itself, when it starts its first tile, so that
+ * they are first touched on the worker's NUMA node. */
+static void
+noise_worker_setup (NoiseJob *job, NoiseWorker *w)
+{
+  w->noise = noise_source_new (job->noise_spec, job->size, job->size);
+  g_assert (w->noise != NULL);
+  w->rng = gsl_rng_clone (job->rng);
+  w->img = saw_surface_new (job->size, job->size);
+  w->tmp = saw_temp_file_new ();
+  if (w->tmp == NULL) {
+    const char *msg = errno ? strerror (errno) : "Unexpected error";
+    fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
+             msg);
+    exit (5);
+  }
+}
+
+/* Generate and process one random tile, and then queue another if
+ * the target hasn't been reached yet, unless replaying a single
+ * tile. */
+static void
+noise_tile_task (SawScheduler *sched, int worker, gpointer data,
+                 gpointer user_data)
+{
+  NoiseJob *job = (NoiseJob *) user_data;
+  NoiseWorker *w = &job->workers[worker];
+  int tile = GPOINTER_TO_INT (data);
+
+  if (g_atomic_int_get (&job->failed) || saw_shutdown_requested ()) return;
+  if (w->img == NULL) noise_worker_setup (job, w);
+
+  /* Wait for room for the temporary file and the lines */
+  gsize pixels = (gsize) job->size * job->size;
+  gsize room = saw_mem_begin_tile (pixels
+                                   * saw_precision_pixel_size (job->precision));
+
+  /* Random images never repeat, so don't bother with the cache. */
+  noise_source_fill_tile (w->noise, w->rng, job->seed, tile, w->img);
+  SawLines *lines = detect_surface_lines (w->img, w->tmp->path, job->scale,
+                                          job->precision);
+  if (job->validate_precision) {
+    SawLines *ref = detect_surface_lines (w->img, w->tmp->path, job->scale,
+                                          SAW_PRECISION_FLOAT32);
+    saw_line_summary_add (&w->ref_summary, ref);
+    saw_line_summary_add (&w->test_summary, lines);
+    saw_lines_free (ref);
+  }
+  if (job->dump_prefix != NULL) dump_tile (job->dump_prefix, w->img, lines);
+  if (!dump_saw_stats (lines, tile, job->out)) {
+    job->error = errno;
+    g_atomic_int_set (&job->failed, 1);
+  }
+  g_atomic_int_inc (&job->num_tiles);
+  int n = g_atomic_int_add (&job->num_lines, lines->num_lines);
+  n += lines->num_lines;
+  saw_lines_free (lines);
+  saw_mem_end_tile (room);
+
+  if (!job->replay && n < job->target) {
+    tile = g_atomic_int_add (&job->next_tile, 1);
+    saw_scheduler_push (sched, worker, noise_tile_task,
+                        GINT_TO_POINTER (tile));
+  }
+}
+
+/* Generate random tiles on num_threads workers until target lines
+ * have been found, or only the given tile if replay_tile >= 0.  Takes
+ * ownership of noise, which is only used to size the workers' own
+ * noise sources. */
+static void
+noise_generate (NoiseJob *job, NoiseSource *noise, const char *noise_spec,
+                int size, gsl_rng *rng, int num_threads, int replay_tile)
+{
+  if (replay_tile >= 0 || job->target <= 0) num_threads = 1;
+
+  job->size = size;
+  job->noise_spec = noise_spec;
+  job->rng = rng;
+  guint64 file_mem = ((guint64) size * size
+                      * saw_precision_pixel_size (job->precision));
+  guint64 worker_mem = ((guint64) size * size * sizeof (float)
+                        + noise_source_size (noise));
+  noise_source_free (noise);
+
+  /* Only start as many workers as there is memory for, allowing for
+   * the temporary file of the first tile each will process.  Workers
+   * allocate their own buffers when they start (see
+   * noise_worker_setup()). */
+  for (int i = 1; i < num_threads; i++) {
+    if (!saw_mem_fits ((i + 1) * worker_mem + file_mem)) {
+      fprintf (stderr, "Memory limit allows only %i of %i workers\n",
+               i, num_threads);
+      num_threads = i;
+      break;
+    }
+  }
+  job->workers = g_new0 (NoiseWorker, num_threads);
+
+  /* Start each worker on one tile; each then queues the next tile
+   * when it finishes, until the target is reached. */
+  SawScheduler *sched = saw_scheduler_new (num_threads, job);
+  if (replay_tile >= 0) {
+    job->replay = TRUE;
+    saw_scheduler_push (sched, 0, noise_tile_task,
+                        GINT_TO_POINTER (replay_tile));
+  } else {
+    for (int i = 0; i < num_threads; i++) {
+      saw_scheduler_push (sched, i, noise_tile_task, GINT_TO_POINTER (i));
+    }
+    job->next_tile = num_threads;
+  }
+  saw_scheduler_run (sched);
+  if (num_threads > 1) saw_scheduler_report (sched, stderr);
+  saw_scheduler_free (sched);
+
+  /* A replay processes exactly the one tile, unless interrupted. */
+  g_assert (!job->replay || job->num_tiles == 1
+            || saw_shutdown_requested ());
+
+  SawLineSummary ref_summary = {0}, test_summary = {0};
+  for (int i = 0; i < num_threads; i++) {
+    NoiseWorker *w = &job->workers[i];
+    saw_line_summary_merge (&ref_summary, &w->ref_summary);
+    saw_line_summary_merge (&test_summary, &w->test_summary);
+    saw_temp_file_free (w->tmp);
+    saw_surface_free (w->img);
+    gsl_rng_free (w->rng);
+    noise_source_free (w->noise);
+  }
+  g_free (job->workers);
+  job->workers = NULL;
+
+  if (job->validate_precision) {
+    saw_precision_report (job->precision, &ref_summary, &test_summary,
+                          stderr);
+  }
+}
 
 int
 main (int argc, char **argv)
@@ -188,13 +976,38 @@ main (int argc, char **argv)
   int gen_size = 2048;
   int gen_target = -1;
   int gen_seed = -1;
+  int saw_length = -1;
+  int num_threads = -1;
+  int reserve_cpus = 0;
+  guint64 mem_limit = 0;
+  const char *sample_file = NULL;
+  int sample_size = 100;
+  const char *bootstrap_file = NULL;
+  int bootstrap_replicates = 1000;
+  const char *histogram_file = NULL;
+  double histogram_nu = 0.75;
+  int aggregate = 0;
+  int components = 0;
+  int buffer_kib = 1024;
+  int tile_overlap = -1;
+  int replay_tile = -1;
+  const char *dump_prefix = NULL;
+  int autotune = 0;
+  SawHugePages huge_pages = SAW_HUGE_PAGES_THP;
+  int numa = 1;
+  SawPrecision precision = SAW_PRECISION_FLOAT32;
+  int validate_precision = 0;
+  SawCompression compression = SAW_COMPRESS_NONE;
+  int compression_set = 0;
+  const char *noise_spec = "S";
   char *infile = NULL;
   char *outfile = NULL;
   float scale = 0;
   int c, status;
 
   /* Parse command-line arguments */
-  while ((c = getopt (argc, argv, GETOPT_OPTIONS)) != -1) {
+  while ((c = getopt_long (argc, argv, GETOPT_OPTIONS, long_options,
+                           NULL)) != -1) {
     switch (c) {
     case 'i':
       if (gen_mode != -1) {
@@ -211,21 +1024,21 @@ main (int argc, char **argv)
         usage (argv[0], 1);
       }
       if (optarg == NULL) {
-        gen_mode = GENERATE_SPECKLE;
+        gen_mode = GENERATE_NOISE;
+      } else if (strcmp (optarg, "W") == 0) {
+        gen_mode = GENERATE_SAW_PIVOT;
+      } else if (strcmp (optarg, "P") == 0) {
+        gen_mode = GENERATE_SAW_PERM;
+      } else if (strcmp (optarg, "X") == 0) {
+        gen_mode = GENERATE_SAW_EXACT;
       } else {
-        switch (optarg[0]) {
-        case 'S': gen_mode = GENERATE_SPECKLE;
-        case 'N': gen_mode = GENERATE_NORM;
-        default:
-          fprintf (stderr, "ERROR: Bad argument '%s' to -r option.\n\n",
-                   optarg);
-          usage (argv[0], 1);
-        }
+        gen_mode = GENERATE_NOISE;
+        noise_spec = optarg;
       }
       break;
     case 'd':
-      status = sscanf (optarg, "%i", &gen_mode);
-      if (status != 1 || gen_mode < 1) {
+      status = sscanf (optarg, "%i", &gen_size);
+      if (status != 1 || gen_size < 1) {
         fprintf (stderr, "ERROR: Bad argument '%s' to -d option.\n\n",
                  optarg);
         usage (argv[0], 1);
@@ -255,11 +1068,148 @@ main (int argc, char **argv)
         usage (argv[0], 1);
       }
       break;
+    case 'l':
+      status = sscanf (optarg, "%i", &saw_length);
+      if (status != 1 || saw_length < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -l option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'j':
+      status = sscanf (optarg, "%i", &num_threads);
+      if (status != 1 || num_threads < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -j option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'a':
+      aggregate = 1;
+      break;
+    case 'b':
+      status = sscanf (optarg, "%i", &buffer_kib);
+      if (status != 1 || buffer_kib < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -b option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case 'z':
+      if (!saw_compression_parse (optarg, &compression)) {
+        fprintf (stderr, "ERROR: Bad or unsupported argument '%s' to -z "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      compression_set = 1;
+      break;
+    case 'p':
+      ridgetool_stream = 1;
+      break;
+    case 'w':
+      status = sscanf (optarg, "%i", &tile_overlap);
+      if (status != 1 || tile_overlap < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to -w option.\n\n",
+                 optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_REPLAY_TILE:
+      status = sscanf (optarg, "%i", &replay_tile);
+      if (status != 1 || replay_tile < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --replay-tile "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_DUMP:
+      dump_prefix = optarg;
+      break;
+    case OPTION_AUTOTUNE:
+      autotune = 1;
+      break;
+    case OPTION_HUGE_PAGES:
+      if (!saw_huge_pages_parse (optarg, &huge_pages)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --huge-pages "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_NO_NUMA:
+      numa = 0;
+      break;
+    case OPTION_PRECISION:
+      if (!saw_precision_parse (optarg, &precision)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --precision "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_VALIDATE_PRECISION:
+      validate_precision = 1;
+      break;
+    case OPTION_MEM_LIMIT:
+      if (!saw_mem_parse (optarg, &mem_limit) || mem_limit == 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --mem-limit "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_SAMPLE_LINES:
+      sample_file = optarg;
+      break;
+    case OPTION_SAMPLE_SIZE:
+      status = sscanf (optarg, "%i", &sample_size);
+      if (status != 1 || sample_size < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --sample-size "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_BOOTSTRAP:
+      bootstrap_file = optarg;
+      break;
+    case OPTION_BOOTSTRAP_REPLICATES:
+      status = sscanf (optarg, "%i", &bootstrap_replicates);
+      if (status != 1 || bootstrap_replicates < 1) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to "
+                 "--bootstrap-replicates option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_HISTOGRAM:
+      histogram_file = optarg;
+      break;
+    case OPTION_HISTOGRAM_NU:
+      status = sscanf (optarg, "%lf", &histogram_nu);
+      if (status != 1 || !(histogram_nu > 0)) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --histogram-nu "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
+    case OPTION_COMPONENTS:
+      components = 1;
+      break;
+    case OPTION_RESERVE:
+      status = sscanf (optarg, "%i", &reserve_cpus);
+      if (status != 1 || reserve_cpus < 0) {
+        fprintf (stderr, "ERROR: Bad argument '%s' to --reserve "
+                 "option.\n\n", optarg);
+        usage (argv[0], 1);
+      }
+      break;
     case 'h':
       usage (argv[0], 0);
       break;
     case '?':
-      if ((optopt != ':') && (strchr (GETOPT_OPTIONS, optopt) != NULL)) {
+      if (optopt == 0) {
+        fprintf (stderr, "ERROR: Unknown option %s.\n\n", argv[optind - 1]);
+      } else if (optopt >= OPTION_REPLAY_TILE) {
+        fprintf (stderr, "ERROR: %s option requires an argument.\n\n",
+                 argv[optind - 1]);
+      } else if ((optopt != ':')
+                 && (strchr (GETOPT_OPTIONS, optopt) != NULL)) {
         fprintf (stderr, "ERROR: -%c option requires an argument.\n\n", optopt);
       } else if (isprint (optopt)) {
         fprintf (stderr, "ERROR: Unknown option -%c.\n\n", optopt);
@@ -273,11 +1223,88 @@ main (int argc, char **argv)
     }
   }
 
-  if (gen_mode == -1 && !outfile) {
+  saw_buffer_set_policy (huge_pages, numa);
+  saw_mem_set_limit (mem_limit);
+  if (num_threads < 0) num_threads = saw_default_threads (reserve_cpus);
+
+  if (optind < argc) outfile = argv[optind++];
+  if (optind < argc) {
+    fprintf (stderr, "ERROR: Unexpected argument '%s'.\n\n", argv[optind]);
+    usage (argv[0], 1);
+  }
+  if (outfile != NULL && !compression_set
+      && !saw_compression_from_filename (outfile, &compression)) {
+    fprintf (stderr,
+             "ERROR: Compressed output to '%s' is not supported.\n\n",
+             outfile);
+    usage (argv[0], 1);
+  }
+
+  if (gen_mode == -1 && !infile) {
     fprintf (stderr, "ERROR: You must specify '-r' or '-i' options.\n\n");
     usage (argv[0], 1);
   }
 
+  if (replay_tile >= 0 && gen_mode != GENERATE_NOISE) {
+    fprintf (stderr, "ERROR: '--replay-tile' requires random image "
+             "generation with '-r'.\n\n");
+    usage (argv[0], 1);
+  }
+  if (autotune && (gen_mode != GENERATE_NOISE || replay_tile >= 0)) {
+    fprintf (stderr, "ERROR: '--autotune' requires random image generation "
+             "with '-r', and can't be used with '--replay-tile'.\n\n");
+    usage (argv[0], 1);
+  }
+  if (validate_precision
+      && (gen_mode != GENERATE_NOISE || precision == SAW_PRECISION_FLOAT32)) {
+    fprintf (stderr, "ERROR: '--validate-precision' requires random image "
+             "generation with '-r', and a reduced '--precision'.\n\n");
+    usage (argv[0], 1);
+  }
+  if (dump_prefix != NULL && replay_tile < 0) {
+    fprintf (stderr, "ERROR: '--dump' requires '--replay-tile'.\n\n");
+    usage (argv[0], 1);
+  }
+  if (bootstrap_file != NULL && gen_mode != GENERATE_NOISE) {
+    fprintf (stderr, "ERROR: '--bootstrap' requires random image "
+             "generation with '-r'.\n\n");
+    usage (argv[0], 1);
+  }
+  if (histogram_file != NULL && gen_mode == GENERATE_SAW_EXACT) {
+    fprintf (stderr, "ERROR: '--histogram' can't be used with exact "
+             "enumeration.\n\n");
+    usage (argv[0], 1);
+  }
+  if (sample_file != NULL && gen_mode != GENERATE_NOISE
+      && (infile == NULL || tile_overlap >= 0)) {
+    fprintf (stderr, "ERROR: '--sample-lines' requires '-r', or '-i' "
+             "without '-w'.\n\n");
+    usage (argv[0], 1);
+  }
+
+  if (saw_length < 0) {
+    saw_length = (gen_mode == GENERATE_SAW_EXACT) ? 20 : 1000;
+  }
+  if (gen_mode == GENERATE_SAW_EXACT && saw_length > ENUM_MAX_LENGTH) {
+    fprintf (stderr, "ERROR: Exact enumeration is limited to %i steps.\n\n",
+             ENUM_MAX_LENGTH);
+    usage (argv[0], 1);
+  }
+
+  NoiseSource *noise = NULL;
+  if (gen_mode == GENERATE_NOISE) {
+    noise = noise_source_new (noise_spec, gen_size, gen_size);
+    if (noise == NULL) {
+      fprintf (stderr, "ERROR: Bad argument '%s' to -r option.\n\n",
+               noise_spec);
+      usage (argv[0], 1);
+    }
+  }
+
+  /* Handle termination signals gracefully.  This must be done before
+   * any threads are started. */
+  saw_shutdown_init ();
+
   FILE *outfp = stdout;
   if (outfile != NULL) {
     outfp = fopen (outfile, "wb");
@@ -288,94 +1315,164 @@ main (int argc, char **argv)
       exit (4);
     }
   }
+  SawOutput *out = saw_output_new (outfp,
+                                   aggregate || gen_mode == GENERATE_SAW_EXACT,
+                                   (gen_mode == GENERATE_SAW_PERM),
+                                   components);
+  if (buffer_kib > 0 || compression != SAW_COMPRESS_NONE) {
+    saw_output_start_writer (out, (gsize) buffer_kib << 10, compression,
+                             num_threads);
+  }
+  if (sample_file != NULL) {
+    out->sampler = saw_sampler_new (sample_size,
+                                    (gen_seed >= 0) ? gen_seed : 0);
+  }
+  if (bootstrap_file != NULL) out->bootstrap = saw_bootstrap_new ();
+  if (histogram_file != NULL) {
+    out->histogram = saw_histogram_new (histogram_nu);
+  }
 
-  if (infile != NULL) {
-    /* Load and process input file */
-    RioData *data = run_ridgetool_get_data (infile, scale);
-    status = dump_saw_stats (data, outfp);
+  if (infile != NULL && tile_overlap >= 0) {
+    /* Process input file in tiles */
+    status = tiled_process_file (infile, gen_size, tile_overlap, scale,
+                                 precision, num_threads, out);
     if (!status) {
       const char *msg = errno ? strerror (errno) : "Unexpected error";
       fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
       exit (4);
     }
-    rio_data_destroy (data);
 
-  } else if (gen_mode != -1) {
-    int N = 0;
+  } else if (infile != NULL) {
+    /* Load and process input file */
+    SawLines *lines = detect_lines (infile, scale);
+    status = dump_saw_stats (lines, -1, out);
+    if (!status) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
+      exit (4);
+    }
+    saw_lines_free (lines);
 
-    /* Initialise RNG. */
-    gsl_rng_env_setup ();
-    gsl_rng *rng = gsl_rng_alloc (gsl_rng_default);
-    if (gen_seed >= 0) {
-      gsl_rng_set (rng, (unsigned int) gen_seed);
+  } else if (gen_mode == GENERATE_SAW_PIVOT) {
+    /* Sample reference self-avoiding walks */
+    gsl_rng *rng = rng_new (gen_seed);
+    status = pivot_generate (rng, saw_length,
+                             (gen_target > 0) ? gen_target : 1, out);
+    if (!status) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
+      exit (4);
     }
-    fprintf (stderr, "Random number seed: %lu (%s)\n",
-             (gen_seed >= 0) ? gen_seed : gsl_rng_default_seed,
-             gsl_rng_name (rng));
-
-    /* Get a temporary filename. FIXME we don't use this in a secure
-     * way, unfortunately. */
-    gchar *tmpfile = g_strdup ("ridge-saw.XXXXXX");
-    int tmpfd = mkstemp (tmpfile);
-    if (tmpfd == -1) {
+    gsl_rng_free (rng);
+
+  } else if (gen_mode == GENERATE_SAW_PERM) {
+    /* Grow weighted reference self-avoiding walks */
+    gsl_rng *rng = rng_new (gen_seed);
+    status = perm_generate (rng, saw_length,
+                            (gen_target > 0) ? gen_target : 1,
+                            num_threads, out);
+    if (!status) {
       const char *msg = errno ? strerror (errno) : "Unexpected error";
-      fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
-               msg);
-      exit (5);
+      fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
+      exit (4);
     }
+    gsl_rng_free (rng);
 
-    /* Repeatedly generate and process random images */
-    RutSurface *img = rut_surface_new (gen_size, gen_size);
-    do {
-
-      /* Generate random data */
-      for (int i = 0; i < img->rows; i++) {
-        for (int j = 0; j < img->cols; j++) {
-          double val;
-          switch (gen_mode) {
-          case GENERATE_NORM:
-            val = gsl_ran_gaussian (rng, 1);
-            break;
-          case GENERATE_SPECKLE:
-            val = gsl_ran_rayleigh (rng, 1);
-            break;
-          default:
-            g_assert_not_reached ();
-          }
-          RUT_SURFACE_REF(img,i,j) = (float) val;
-        }
-      }
+  } else if (gen_mode == GENERATE_SAW_EXACT) {
+    /* Enumerate all self-avoiding walks */
+    enum_generate (saw_length, num_threads, out);
 
-      /* Output to TIFF file */
-      status = rut_surface_to_tiff (img, tmpfile);
-      if (!status) {
-        fprintf (stderr, "ERROR: Failed to write image data to '%s'.\n\n",
-                 tmpfile);
-        exit (5);
-      }
+  } else if (gen_mode == GENERATE_NOISE) {
+    /* Initialise RNG.  It is reseeded for each tile. */
+    gsl_rng *rng = rng_new (gen_seed);
+    unsigned long seed = (gen_seed >= 0) ? gen_seed : gsl_rng_default_seed;
 
-      /* Process TIFF file */
-      RioData *data = run_ridgetool_get_data (tmpfile, scale);
-      status = dump_saw_stats (data, outfp);
+    /* Choose tile size */
+    if (autotune) {
+      SawTuning tuning;
+      autotune_noise (noise_spec, scale, precision, rng, seed, &tuning);
+      gen_size = tuning.tile_size;
+      noise_source_free (noise);
+      noise = noise_source_new (noise_spec, gen_size, gen_size);
+
+      gchar *header = g_strdup_printf ("autotune: -d %i%s, %.1f usable "
+                                       "lines/s", gen_size,
+                                       tuning.stream ? " -p" : "",
+                                       tuning.rate);
+      fprintf (stderr, "%s\n", header);
+      status = saw_output_comment (out, header);
       if (!status) {
         const char *msg = errno ? strerror (errno) : "Unexpected error";
         fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
         exit (4);
       }
-      rio_data_destroy (data);
-
-    } while (N < gen_target);
+      g_free (header);
+    }
 
-    close (tmpfd);
-    unlink (tmpfile);
-    g_free (tmpfile);
-    rut_surface_destroy (img);
+    /* Repeatedly generate and process random images */
+    NoiseJob job;
+    memset (&job, 0, sizeof (job));
+    job.seed = seed;
+    job.scale = scale;
+    job.precision = precision;
+    job.validate_precision = validate_precision;
+    job.dump_prefix = dump_prefix;
+    job.target = gen_target;
+    job.out = out;
+    noise_generate (&job, noise, noise_spec, gen_size, rng, num_threads,
+                    replay_tile);
+    if (job.failed) {
+      const char *msg = job.error ? strerror (job.error) : "Unexpected error";
+      fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
+      exit (4);
+    }
     gsl_rng_free (rng);
 
   } else {
     g_assert_not_reached ();
   }
 
+  status = saw_output_finish (out);
+  if (!status) {
+    const char *msg = errno ? strerror (errno) : "Unexpected error";
+    fprintf (stderr, "ERROR: Output failed: %s\n\n", msg);
+    exit (4);
+  }
+  if (out->sampler != NULL) {
+    if (!saw_sampler_write (out->sampler, sample_file)) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to write line sample to '%s': %s\n\n",
+               sample_file, msg);
+      exit (4);
+    }
+    saw_sampler_free (out->sampler);
+    out->sampler = NULL;
+  }
+  if (out->bootstrap != NULL) {
+    if (!saw_bootstrap_write (out->bootstrap, bootstrap_file,
+                              bootstrap_replicates, num_threads,
+                              (gen_seed >= 0) ? gen_seed : 0)) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to write bootstrap estimates to "
+               "'%s': %s\n\n", bootstrap_file, msg);
+      exit (4);
+    }
+    saw_bootstrap_free (out->bootstrap);
+    out->bootstrap = NULL;
+  }
+  if (out->histogram != NULL) {
+    if (!saw_histogram_write (out->histogram, histogram_file)) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to write histogram to '%s': %s\n\n",
+               histogram_file, msg);
+      exit (4);
+    }
+    saw_histogram_free (out->histogram);
+    out->histogram = NULL;
+  }
+  guint64 num_records = out->num_records;
+  saw_output_free (out);
+
   if (outfp != stdout) {
     status = fclose (outfp);
     if (status != 0) {
@@ -385,5 +1482,8 @@ main (int argc, char **argv)
       exit (4);
     }
   }
+
+  if (mem_limit > 0) saw_mem_report (stderr);
+  saw_shutdown_exit_if_requested (num_records);
   exit (0);
 }
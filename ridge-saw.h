@@ -0,0 +1,399 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef RIDGE_SAW_H
+#define RIDGE_SAW_H
+
+#include <stdio.h>
+
+#include <glib.h>
+#include <gsl/gsl_rng.h>
+#include <ridgeio.h>
+#include <ridgeutil.h>
+
+/* ---------------------------------------------------------------- */
+/* ridge-saw.c */
+
+/* Compact line data: the (row, col) pixel coordinates of the points of
+ * each line, stored consecutively.  Line i has points offsets[i] to
+ * offsets[i+1] - 1. */
+typedef struct _SawLines SawLines;
+
+struct _SawLines
+{
+  guint num_lines;
+  guint num_points;
+  guint32 *offsets;
+  gint32 *points;
+};
+
+/* Precision of image data passed to ridgetool (see precision.c). */
+typedef enum {
+  SAW_PRECISION_FLOAT32 = 0,
+  SAW_PRECISION_INT16,
+} SawPrecision;
+
+const gchar *get_ridgetool_path (void);
+RioData *run_ridgetool_get_data (const char *filename, float scale);
+SawLines *detect_lines (const char *filename, float scale);
+SawLines *detect_surface_lines (RutSurface *img, const char *path,
+                                float scale, SawPrecision precision);
+int get_ridgetool_stream (void);
+void set_ridgetool_stream (int stream);
+
+/* ---------------------------------------------------------------- */
+/* lines.c */
+
+SawLines *saw_lines_new (guint num_lines, guint num_points);
+void saw_lines_free (SawLines *lines);
+gsize saw_lines_size (const SawLines *lines);
+SawLines *saw_lines_from_rio_data (RioData *data);
+
+/* ---------------------------------------------------------------- */
+/* tempfile.c */
+
+/* Temporary file, which other programs can access by path. */
+typedef struct _SawTempFile SawTempFile;
+
+struct _SawTempFile
+{
+  int fd;
+  gchar *path;
+  gboolean named;  /* Whether path must be unlinked */
+};
+
+SawTempFile *saw_temp_file_new (void);
+void saw_temp_file_free (SawTempFile *tmp);
+
+/* ---------------------------------------------------------------- */
+/* shutdown.c */
+
+void saw_shutdown_init (void);
+gboolean saw_shutdown_requested (void);
+void saw_shutdown_add_child (GPid pid);
+void saw_shutdown_remove_child (GPid pid);
+void saw_shutdown_exit_if_requested (guint64 num_records);
+
+/* ---------------------------------------------------------------- */
+/* buffer.c */
+
+typedef enum {
+  SAW_HUGE_PAGES_OFF = 0,
+  SAW_HUGE_PAGES_THP,
+  SAW_HUGE_PAGES_EXPLICIT,
+} SawHugePages;
+
+int saw_huge_pages_parse (const char *name, SawHugePages *mode);
+void saw_buffer_set_policy (SawHugePages huge_pages, gboolean numa);
+void saw_buffer_advise (gpointer buf, gsize size);
+gpointer saw_buffer_alloc (gsize size);
+void saw_buffer_free (gpointer buf, gsize size);
+RutSurface *saw_surface_new (int rows, int cols);
+void saw_surface_free (RutSurface *img);
+int saw_numa_bind_worker (int index);
+
+/* ---------------------------------------------------------------- */
+/* memory.c */
+
+int saw_mem_parse (const char *str, guint64 *size);
+void saw_mem_set_limit (guint64 limit);
+guint64 saw_mem_get_used (void);
+gboolean saw_mem_fits (guint64 size);
+void saw_mem_charge (gsize size);
+void saw_mem_charge_lines (gsize size);
+void saw_mem_credit (gsize size);
+gsize saw_mem_begin_tile (gsize image_size);
+void saw_mem_end_tile (gsize size);
+void saw_mem_report (FILE *fp);
+
+/* ---------------------------------------------------------------- */
+/* cpus.c */
+
+int saw_available_cpus (void);
+int saw_default_threads (int reserve);
+
+/* ---------------------------------------------------------------- */
+/* sched.c */
+
+typedef struct _SawScheduler SawScheduler;
+
+typedef void (*SawTaskFunc) (SawScheduler *sched, int worker,
+                             gpointer data, gpointer user_data);
+
+SawScheduler *saw_scheduler_new (int num_workers, gpointer user_data);
+void saw_scheduler_free (SawScheduler *sched);
+void saw_scheduler_push (SawScheduler *sched, int worker, SawTaskFunc func,
+                         gpointer data);
+void saw_scheduler_run (SawScheduler *sched);
+void saw_scheduler_report (const SawScheduler *sched, FILE *fp);
+
+/* ---------------------------------------------------------------- */
+/* precision.c */
+
+int saw_precision_parse (const char *name, SawPrecision *precision);
+const char *saw_precision_name (SawPrecision precision);
+gsize saw_precision_pixel_size (SawPrecision precision);
+int saw_surface_to_tiff (RutSurface *img, const char *filename,
+                         SawPrecision precision);
+
+/* Summary statistics of the lines detected in a set of images. */
+typedef struct _SawLineSummary SawLineSummary;
+
+struct _SawLineSummary
+{
+  guint64 num_images;
+  guint64 num_lines;
+  double sum_steps;
+  double sum_r2;
+};
+
+void saw_line_summary_add (SawLineSummary *summary, const SawLines *lines);
+void saw_line_summary_merge (SawLineSummary *summary,
+                             const SawLineSummary *other);
+void saw_precision_report (SawPrecision precision, const SawLineSummary *ref,
+                           const SawLineSummary *test, FILE *fp);
+
+/* ---------------------------------------------------------------- */
+/* cache.c */
+
+gchar *saw_cache_dir (const char *subdir);
+int saw_cache_enabled (void);
+guint64 saw_cache_key (const char *filename, float scale);
+SawLines *saw_cache_lookup (guint64 key);
+void saw_cache_store (guint64 key, const SawLines *lines);
+
+/* ---------------------------------------------------------------- */
+/* compress.c */
+
+typedef enum {
+  SAW_COMPRESS_NONE = 0,
+  SAW_COMPRESS_GZIP,
+  SAW_COMPRESS_ZSTD,
+} SawCompression;
+
+int saw_compression_parse (const char *name, SawCompression *compression);
+int saw_compression_from_filename (const char *filename,
+                                   SawCompression *compression);
+gsize saw_compress_bound (SawCompression compression, gsize len);
+gsize saw_compress_block (SawCompression compression, const char *src,
+                          gsize len, char *dest, gsize dest_len);
+
+/* ---------------------------------------------------------------- */
+/* sample.c */
+
+/* Per-bin reservoir samples of complete lines. */
+typedef struct _SawSampler SawSampler;
+
+SawSampler *saw_sampler_new (guint per_bin, unsigned long seed);
+void saw_sampler_free (SawSampler *sampler);
+void saw_sampler_add (SawSampler *sampler, const SawLines *lines, int tile);
+int saw_sampler_write (SawSampler *sampler, const char *filename);
+
+/* ---------------------------------------------------------------- */
+/* bootstrap.c */
+
+/* Per-tile partial sums for block bootstrap error estimates. */
+typedef struct _SawBootstrap SawBootstrap;
+
+SawBootstrap *saw_bootstrap_new (void);
+void saw_bootstrap_free (SawBootstrap *boot);
+void saw_bootstrap_add_tile (SawBootstrap *boot, const SawLines *lines,
+                             int tile);
+int saw_bootstrap_write (SawBootstrap *boot, const char *filename,
+                         int num_replicates, int num_threads,
+                         unsigned long seed);
+
+/* ---------------------------------------------------------------- */
+/* histogram.c */
+
+/* Histogram of step count and scaled end-to-end distance. */
+typedef struct _SawHistogram SawHistogram;
+
+SawHistogram *saw_histogram_new (double nu);
+void saw_histogram_free (SawHistogram *hist);
+void saw_histogram_add (SawHistogram *hist, int num_steps, double dx,
+                        double dy, double weight);
+int saw_histogram_write (SawHistogram *hist, const char *filename);
+
+/* ---------------------------------------------------------------- */
+/* output.c */
+
+/* Weighted sums of squared end-to-end displacement components,
+ * indexed by step count. */
+typedef struct _SawStats SawStats;
+
+struct _SawStats
+{
+  int size;
+  double *weight;
+  double *sum_dx2;
+  double *sum_dy2;
+  double *sum_dxdy;
+};
+
+SawStats *saw_stats_new (void);
+void saw_stats_free (SawStats *stats);
+void saw_stats_add (SawStats *stats, int num_steps, double dx, double dy,
+                    double weight);
+void saw_stats_add_sums (SawStats *stats, int num_steps, double weight,
+                         double sum_dx2, double sum_dy2, double sum_dxdy);
+void saw_stats_merge (SawStats *stats, const SawStats *other);
+
+/* Background thread for writing output. */
+typedef struct _SawWriter SawWriter;
+
+/* Destination for line and walk records.  Records are either written
+ * out individually or, in aggregate mode, accumulated into stats. */
+typedef struct _SawOutput SawOutput;
+
+struct _SawOutput
+{
+  FILE *fp;
+  gboolean weighted;
+  gboolean components;  /* Output displacement components too */
+  SawStats *stats;
+  SawWriter *writer;
+  SawSampler *sampler;  /* Optional sample of complete lines */
+  SawBootstrap *bootstrap; /* Optional per-tile partial sums */
+  SawHistogram *histogram; /* Optional distance distribution */
+  guint64 num_records;
+  GMutex mutex;
+};
+
+SawOutput *saw_output_new (FILE *fp, gboolean aggregate, gboolean weighted,
+                           gboolean components);
+void saw_output_free (SawOutput *out);
+void saw_output_start_writer (SawOutput *out, gsize buffer_size,
+                              SawCompression compression, int num_threads);
+int saw_output_record (SawOutput *out, int num_steps, double dx, double dy,
+                       double weight);
+int saw_output_tile_record (SawOutput *out, int tile, int num_steps,
+                            double dx, double dy);
+int saw_output_comment (SawOutput *out, const char *text);
+void saw_output_merge_stats (SawOutput *out, const SawStats *stats);
+int saw_output_finish (SawOutput *out);
+
+/* ---------------------------------------------------------------- */
+/* lattice.c */
+
+/* Open-addressing hash set of occupied square lattice sites.  Each
+ * site maps to the index of the walk step that occupies it. */
+typedef struct _SawSiteHash SawSiteHash;
+
+struct _SawSiteHash
+{
+  guint64 *keys;
+  gint32 *values; /* -1 for an empty slot */
+  guint mask;
+  guint shift;
+};
+
+SawSiteHash *saw_site_hash_new (guint max_entries);
+void saw_site_hash_free (SawSiteHash *hash);
+void saw_site_hash_clear (SawSiteHash *hash);
+gint32 saw_site_hash_lookup (const SawSiteHash *hash, gint32 x, gint32 y);
+void saw_site_hash_insert (SawSiteHash *hash, gint32 x, gint32 y,
+                           gint32 index);
+void saw_site_hash_remove (SawSiteHash *hash, gint32 x, gint32 y);
+
+/* ---------------------------------------------------------------- */
+/* pivot.c */
+
+int pivot_generate (gsl_rng *rng, int length, int num_walks,
+                    SawOutput *out);
+
+/* ---------------------------------------------------------------- */
+/* perm.c */
+
+int perm_generate (gsl_rng *rng, int length, int num_tours, int num_threads,
+                   SawOutput *out);
+
+/* ---------------------------------------------------------------- */
+/* tiled.c */
+
+int tiled_process_file (const char *filename, int tile_size, int overlap,
+                        float scale, SawPrecision precision, int num_threads,
+                        SawOutput *out);
+
+/* ---------------------------------------------------------------- */
+/* noise.c */
+
+typedef enum {
+  CORR_SPECTRUM_GAUSS,
+  CORR_SPECTRUM_EXP,
+  CORR_SPECTRUM_POWER,
+} CorrSpectrumType;
+
+/* Power spectrum of correlated noise.  The parameter is the
+ * correlation length for GAUSS and EXP, and the spectral exponent for
+ * POWER. */
+typedef struct _CorrSpectrum CorrSpectrum;
+
+struct _CorrSpectrum
+{
+  CorrSpectrumType type;
+  double param;
+};
+
+typedef struct _CorrNoise CorrNoise;
+
+int corr_spectrum_parse (const char *str, CorrSpectrum *spectrum);
+CorrNoise *corr_noise_new (int rows, int cols, const CorrSpectrum *spectrum);
+void corr_noise_free (CorrNoise *cn);
+void corr_noise_fill (CorrNoise *cn, const gsl_rng *rng, RutSurface *img);
+
+/* Generator of random images of a particular type and size. */
+typedef struct _NoiseSource NoiseSource;
+
+NoiseSource *noise_source_new (const char *spec, int rows, int cols);
+void noise_source_free (NoiseSource *src);
+gsize noise_source_size (const NoiseSource *src);
+void noise_source_fill (NoiseSource *src, const gsl_rng *rng,
+                        RutSurface *img);
+void noise_source_fill_tile (NoiseSource *src, gsl_rng *rng,
+                             unsigned long seed, int tile, RutSurface *img);
+guint64 noise_mix64 (guint64 z);
+void noise_print_types (FILE *fp);
+
+/* ---------------------------------------------------------------- */
+/* autotune.c */
+
+/* Settings chosen by autotuning. */
+typedef struct _SawTuning SawTuning;
+
+struct _SawTuning
+{
+  int tile_size;
+  int stream;   /* Whether to stream line data through a pipe */
+  double rate;  /* Usable lines per second */
+};
+
+void autotune_noise (const char *noise_spec, float scale,
+                     SawPrecision precision, gsl_rng *rng,
+                     unsigned long seed, SawTuning *tuning);
+
+/* ---------------------------------------------------------------- */
+/* enumerate.c */
+
+/* Beyond this, the sums of squared distance could overflow, and the
+ * enumeration would take far too long anyway. */
+#define ENUM_MAX_LENGTH 32
+
+void enum_generate (int length, int num_threads, SawOutput *out);
+
+#endif /* !RIDGE_SAW_H */
@@ -0,0 +1,236 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "ridge-saw.h"
+
+/* Random samples of complete lines.
+ *
+ * Lines are binned by step count, with bin b holding lines of 2^b to
+ * 2^(b+1) - 1 steps (and bin 0 also holding lines of no steps).  Each
+ * line is given a random key, by mixing the seed with its tile and
+ * its index in the tile, and each bin keeps the per_bin lines with
+ * the smallest keys.  At any point, each bin's kept lines are then a
+ * uniform random sample of the lines seen in that bin, and the memory
+ * used depends only on per_bin and the bin lengths, however many
+ * lines are seen.  Only the kept lines are written out, at the end,
+ * in order of key.
+ *
+ * Because the keys don't depend on the order that tiles arrive in,
+ * the sample is the same for a given seed, however many threads are
+ * used. */
+
+#define SAW_SAMPLER_NUM_BINS 32
+
+typedef struct _SawSample SawSample;
+typedef struct _SawSampleBin SawSampleBin;
+
+struct _SawSample
+{
+  guint64 key;
+  int tile;
+  guint line;     /* Index of the line in its tile */
+  guint num_points;
+  gint32 *points; /* (row, col) pairs */
+};
+
+struct _SawSampleBin
+{
+  guint64 num_seen;
+  guint num_kept;
+  guint max;      /* Kept line with the largest key, once full */
+  SawSample *samples;
+};
+
+struct _SawSampler
+{
+  guint per_bin;
+  guint64 seed;
+  SawSampleBin bins[SAW_SAMPLER_NUM_BINS];
+  GMutex mutex;
+};
+
+SawSampler *
+saw_sampler_new (guint per_bin, unsigned long seed)
+{
+  g_assert (per_bin > 0);
+  SawSampler *sampler = g_new0 (SawSampler, 1);
+  sampler->per_bin = per_bin;
+  sampler->seed = noise_mix64 (seed);
+  g_mutex_init (&sampler->mutex);
+  return sampler;
+}
+
+static gsize
+saw_sample_size (const SawSample *sample)
+{
+  return 2 * (gsize) sample->num_points * sizeof (gint32);
+}
+
+void
+saw_sampler_free (SawSampler *sampler)
+{
+  if (sampler == NULL) return;
+  for (int b = 0; b < SAW_SAMPLER_NUM_BINS; b++) {
+    SawSampleBin *bin = &sampler->bins[b];
+    for (guint i = 0; i < bin->num_kept; i++) {
+      saw_mem_credit (saw_sample_size (&bin->samples[i]));
+      g_free (bin->samples[i].points);
+    }
+    g_free (bin->samples);
+  }
+  g_mutex_clear (&sampler->mutex);
+  g_free (sampler);
+}
+
+static int
+saw_sampler_bin (guint num_steps)
+{
+  int b = 0;
+  while (num_steps > 1 && b < SAW_SAMPLER_NUM_BINS - 1) {
+    num_steps >>= 1;
+    b++;
+  }
+  return b;
+}
+
+/* Order samples by key, breaking (very unlikely) ties by tile and
+ * line, so that the order never depends on when lines were added. */
+static int
+saw_sample_compare (gconstpointer a, gconstpointer b)
+{
+  const SawSample *sa = a, *sb = b;
+  if (sa->key != sb->key) return (sa->key < sb->key) ? -1 : 1;
+  if (sa->tile != sb->tile) return (sa->tile < sb->tile) ? -1 : 1;
+  if (sa->line != sb->line) return (sa->line < sb->line) ? -1 : 1;
+  return 0;
+}
+
+static void
+saw_sample_set (SawSample *sample, guint64 key, const SawLines *lines,
+                guint line, int tile)
+{
+  if (sample->points != NULL) {
+    saw_mem_credit (saw_sample_size (sample));
+    g_free (sample->points);
+  }
+  sample->key = key;
+  sample->tile = tile;
+  sample->line = line;
+  sample->num_points = lines->offsets[line+1] - lines->offsets[line];
+  sample->points = g_malloc (saw_sample_size (sample));
+  memcpy (sample->points, &lines->points[2 * lines->offsets[line]],
+          saw_sample_size (sample));
+  saw_mem_charge (saw_sample_size (sample));
+}
+
+/* Find the kept line with the largest key in a full bin. */
+static void
+saw_sampler_bin_update_max (SawSampleBin *bin)
+{
+  bin->max = 0;
+  for (guint i = 1; i < bin->num_kept; i++) {
+    if (saw_sample_compare (&bin->samples[i],
+                            &bin->samples[bin->max]) > 0) {
+      bin->max = i;
+    }
+  }
+}
+
+/* Offer all of the lines detected in a tile (or -1 for an input file)
+ * to the sampler.  Safe to call from several threads at once. */
+void
+saw_sampler_add (SawSampler *sampler, const SawLines *lines, int tile)
+{
+  guint64 tile_key = noise_mix64 (sampler->seed ^ (guint64) tile);
+
+  g_mutex_lock (&sampler->mutex);
+  for (guint i = 0; i < lines->num_lines; i++) {
+    guint num_steps = lines->offsets[i+1] - lines->offsets[i] - 1;
+    SawSampleBin *bin = &sampler->bins[saw_sampler_bin (num_steps)];
+    SawSample candidate = {noise_mix64 (tile_key ^ i), tile, i, 0, NULL};
+    bin->num_seen++;
+
+    if (bin->num_kept < sampler->per_bin) {
+      if (bin->samples == NULL) {
+        bin->samples = g_new0 (SawSample, sampler->per_bin);
+      }
+      saw_sample_set (&bin->samples[bin->num_kept++], candidate.key,
+                      lines, i, tile);
+      if (bin->num_kept == sampler->per_bin) {
+        saw_sampler_bin_update_max (bin);
+      }
+      continue;
+    }
+
+    /* Keep the line in place of the kept line with the largest key, if
+     * its own key is smaller. */
+    if (saw_sample_compare (&candidate, &bin->samples[bin->max]) < 0) {
+      saw_sample_set (&bin->samples[bin->max], candidate.key, lines, i,
+                      tile);
+      saw_sampler_bin_update_max (bin);
+    }
+  }
+  g_mutex_unlock (&sampler->mutex);
+}
+
+/* Write the kept lines to a CSV file, one point per row, in the format
+ * "bin, line, tile, row, col", with each bin's lines in order of key.
+ * Each bin is preceded by a "#" comment giving the number of lines
+ * seen in it, which is needed to weight the samples.  Returns 0 and
+ * sets errno on failure. */
+int
+saw_sampler_write (SawSampler *sampler, const char *filename)
+{
+  FILE *fp = fopen (filename, "w");
+  if (fp == NULL) return 0;
+
+  int status = 1;
+  guint line = 0;
+  for (int b = 0; status && b < SAW_SAMPLER_NUM_BINS; b++) {
+    SawSampleBin *bin = &sampler->bins[b];
+    if (bin->num_seen == 0) continue;
+    qsort (bin->samples, bin->num_kept, sizeof (SawSample),
+           saw_sample_compare);
+    bin->max = bin->num_kept - 1;
+
+    status = (fprintf (fp, "# bin %i: %u of %" G_GUINT64_FORMAT
+                       " lines of %u to %u steps\n", b, bin->num_kept,
+                       bin->num_seen, (b == 0) ? 0 : 1u << b,
+                       (b == SAW_SAMPLER_NUM_BINS - 1)
+                       ? G_MAXUINT : (2u << b) - 1) >= 0);
+
+    for (guint i = 0; status && i < bin->num_kept; i++, line++) {
+      const SawSample *sample = &bin->samples[i];
+      for (guint k = 0; status && k < sample->num_points; k++) {
+        status = (fprintf (fp, "%i, %u, %i, %i, %i\n", b, line, sample->tile,
+                           sample->points[2*k],
+                           sample->points[2*k + 1]) >= 0);
+      }
+    }
+  }
+
+  if (fclose (fp) != 0) status = 0;
+  if (!status && errno == 0) errno = EIO;
+  return status;
+}
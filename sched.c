@@ -0,0 +1,252 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include "ridge-saw.h"
+
+/* Work-stealing task scheduler for tile workers.
+ *
+ * The time taken to detect lines in a tile varies a lot with the line
+ * density and the detection scale, so tiles aren't shared out between
+ * workers in advance.  Instead, each worker has its own queue of
+ * tasks.  A worker takes tasks from the back of its own queue, and
+ * tasks that it creates are added there too, so it mostly works on
+ * neighbouring tiles.  When its queue is empty, it steals a task from
+ * the front of another worker's queue, where the tasks furthest from
+ * that worker's current one are.  The run finishes when every queue
+ * is empty and no task is running.
+ *
+ * Tasks are expected to be coarse (a whole tile each), so queues are
+ * simply protected by a mutex per worker, and idle workers sleep until
+ * another task is queued rather than spinning. */
+
+typedef struct _SawTask SawTask;
+typedef struct _SawSchedWorker SawSchedWorker;
+
+struct _SawTask
+{
+  SawTaskFunc func;
+  gpointer data;
+};
+
+struct _SawSchedWorker
+{
+  SawScheduler *sched;
+  int index;
+  GThread *thread;
+
+  GMutex mutex;
+  GArray *tasks;   /* Tasks queued, from head to the end */
+  guint head;
+
+  gint64 busy;     /* Time spent running tasks, in us */
+  gint64 idle;     /* Time spent looking for tasks, in us */
+  guint num_tasks;
+  guint num_stolen;
+};
+
+struct _SawScheduler
+{
+  int num_workers;
+  SawSchedWorker *workers;
+  gpointer user_data;
+
+  volatile gint pending;     /* Tasks queued or running */
+  volatile gint generation;  /* Incremented when a task is queued */
+  GMutex idle_mutex;
+  GCond idle_cond;
+
+  gint64 elapsed;            /* Wall-clock time of run, in us */
+};
+
+SawScheduler *
+saw_scheduler_new (int num_workers, gpointer user_data)
+{
+  g_assert (num_workers > 0);
+
+  SawScheduler *sched = g_new0 (SawScheduler, 1);
+  sched->num_workers = num_workers;
+  sched->user_data = user_data;
+  sched->workers = g_new0 (SawSchedWorker, num_workers);
+  for (int i = 0; i < num_workers; i++) {
+    SawSchedWorker *w = &sched->workers[i];
+    w->sched = sched;
+    w->index = i;
+    g_mutex_init (&w->mutex);
+    w->tasks = g_array_new (FALSE, FALSE, sizeof (SawTask));
+  }
+  g_mutex_init (&sched->idle_mutex);
+  g_cond_init (&sched->idle_cond);
+  return sched;
+}
+
+void
+saw_scheduler_free (SawScheduler *sched)
+{
+  if (sched == NULL) return;
+  for (int i = 0; i < sched->num_workers; i++) {
+    SawSchedWorker *w = &sched->workers[i];
+    g_mutex_clear (&w->mutex);
+    g_array_free (w->tasks, TRUE);
+  }
+  g_mutex_clear (&sched->idle_mutex);
+  g_cond_clear (&sched->idle_cond);
+  g_free (sched->workers);
+  g_free (sched);
+}
+
+static void
+saw_scheduler_wake (SawScheduler *sched)
+{
+  g_mutex_lock (&sched->idle_mutex);
+  g_atomic_int_inc (&sched->generation);
+  g_cond_broadcast (&sched->idle_cond);
+  g_mutex_unlock (&sched->idle_mutex);
+}
+
+/* Add a task to the back of a worker's queue.  Tasks may be queued
+ * before the scheduler is run, or by running tasks, usually on their
+ * own worker. */
+void
+saw_scheduler_push (SawScheduler *sched, int worker, SawTaskFunc func,
+                    gpointer data)
+{
+  g_assert (worker >= 0 && worker < sched->num_workers);
+  SawSchedWorker *w = &sched->workers[worker];
+  SawTask task = {func, data};
+
+  /* Count the task before it can be taken, so that pending can't drop
+   * to zero while it's queued. */
+  g_atomic_int_inc (&sched->pending);
+  g_mutex_lock (&w->mutex);
+  g_array_append_val (w->tasks, task);
+  g_mutex_unlock (&w->mutex);
+  saw_scheduler_wake (sched);
+}
+
+/* Take a task from the back (if !steal) or front of a worker's
+ * queue. */
+static gboolean
+saw_scheduler_take (SawSchedWorker *w, gboolean steal, SawTask *task)
+{
+  gboolean found = FALSE;
+  g_mutex_lock (&w->mutex);
+  if (w->head < w->tasks->len) {
+    if (steal) {
+      *task = g_array_index (w->tasks, SawTask, w->head++);
+    } else {
+      *task = g_array_index (w->tasks, SawTask, w->tasks->len - 1);
+      g_array_set_size (w->tasks, w->tasks->len - 1);
+    }
+    if (w->head == w->tasks->len) {
+      w->head = 0;
+      g_array_set_size (w->tasks, 0);
+    }
+    found = TRUE;
+  }
+  g_mutex_unlock (&w->mutex);
+  return found;
+}
+
+static gpointer
+saw_scheduler_thread (gpointer user_data)
+{
+  SawSchedWorker *w = (SawSchedWorker *) user_data;
+  SawScheduler *sched = w->sched;
+  int n = sched->num_workers;
+
+  saw_numa_bind_worker (w->index);
+
+  gint64 start = g_get_monotonic_time ();
+  for (;;) {
+    gint generation = g_atomic_int_get (&sched->generation);
+    SawTask task;
+    gboolean stolen = FALSE;
+    gboolean found = saw_scheduler_take (w, FALSE, &task);
+
+    /* Look for work on the other workers, starting with the next
+     * one, so that thieves spread out over the victims. */
+    for (int i = 1; !found && i < n; i++) {
+      SawSchedWorker *victim = &sched->workers[(w->index + i) % n];
+      found = stolen = saw_scheduler_take (victim, TRUE, &task);
+    }
+
+    if (found) {
+      gint64 t = g_get_monotonic_time ();
+      task.func (sched, w->index, task.data, sched->user_data);
+      w->busy += g_get_monotonic_time () - t;
+      w->num_tasks++;
+      if (stolen) w->num_stolen++;
+      if (g_atomic_int_dec_and_test (&sched->pending)) {
+        saw_scheduler_wake (sched);
+      }
+      continue;
+    }
+
+    /* Nothing to do.  Finish if no tasks are running either;
+     * otherwise, wait for a running task to queue another one or
+     * finish. */
+    g_mutex_lock (&sched->idle_mutex);
+    while (g_atomic_int_get (&sched->pending) > 0
+           && g_atomic_int_get (&sched->generation) == generation) {
+      g_cond_wait (&sched->idle_cond, &sched->idle_mutex);
+    }
+    g_mutex_unlock (&sched->idle_mutex);
+    if (g_atomic_int_get (&sched->pending) == 0) break;
+  }
+  w->idle = g_get_monotonic_time () - start - w->busy;
+  return NULL;
+}
+
+/* Run all queued tasks, and any tasks they queue, on the workers'
+ * threads, and wait for them to finish. */
+void
+saw_scheduler_run (SawScheduler *sched)
+{
+  gint64 start = g_get_monotonic_time ();
+  for (int i = 0; i < sched->num_workers; i++) {
+    SawSchedWorker *w = &sched->workers[i];
+    w->thread = g_thread_new ("worker", saw_scheduler_thread, w);
+  }
+  for (int i = 0; i < sched->num_workers; i++) {
+    g_thread_join (sched->workers[i].thread);
+    sched->workers[i].thread = NULL;
+  }
+  sched->elapsed += g_get_monotonic_time () - start;
+}
+
+/* Print the time each worker spent running tasks and looking for
+ * them, so that scaling with the number of workers can be checked. */
+void
+saw_scheduler_report (const SawScheduler *sched, FILE *fp)
+{
+  gint64 busy = 0;
+  for (int i = 0; i < sched->num_workers; i++) {
+    const SawSchedWorker *w = &sched->workers[i];
+    fprintf (fp, "Worker %i: %u tasks (%u stolen), busy %.3f s, "
+             "idle %.3f s\n", i, w->num_tasks, w->num_stolen,
+             w->busy / 1e6, w->idle / 1e6);
+    busy += w->busy;
+  }
+  if (sched->elapsed > 0) {
+    fprintf (fp, "Workers busy for %.1f%% of %.3f s\n",
+             100.0 * busy / ((double) sched->elapsed * sched->num_workers),
+             sched->elapsed / 1e6);
+  }
+}
@@ -0,0 +1,147 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+
+#include "ridge-saw.h"
+
+/* Graceful shutdown on SIGINT, SIGTERM and SIGHUP.
+ *
+ * The signals are blocked in every thread, and received synchronously
+ * with sigwait() by a dedicated thread, so there are no restrictions
+ * on what can be done when one arrives.  The first signal just sets a
+ * flag: generators stop starting new work, but finish whatever is in
+ * flight, and then all output and aggregate statistics are written out
+ * and temporary files removed as usual.  A second signal aborts
+ * immediately, killing any running ridgetool processes.
+ *
+ * ridgetool is run in its own process group, so that a SIGINT from
+ * the terminal doesn't kill it halfway through the tile it is
+ * working on. */
+
+static volatile gint shutdown_signal = 0;
+
+static GMutex children_mutex;
+static GArray *children = NULL; /* Running child process IDs */
+
+static sigset_t
+saw_shutdown_sigset (void)
+{
+  sigset_t set;
+  sigemptyset (&set);
+  sigaddset (&set, SIGINT);
+  sigaddset (&set, SIGTERM);
+  sigaddset (&set, SIGHUP);
+  return set;
+}
+
+static gpointer
+saw_shutdown_thread (gpointer user_data)
+{
+  sigset_t set = saw_shutdown_sigset ();
+  int sig;
+
+  for (;;) {
+    if (sigwait (&set, &sig) != 0) continue;
+
+    if (g_atomic_int_get (&shutdown_signal) == 0) {
+      g_atomic_int_set (&shutdown_signal, sig);
+      fprintf (stderr, "%s: finishing current work and writing output.  "
+               "Repeat to abort.\n", strsignal (sig));
+      continue;
+    }
+
+    /* Second signal: abort */
+    g_mutex_lock (&children_mutex);
+    for (guint i = 0; children != NULL && i < children->len; i++) {
+      kill (-g_array_index (children, GPid, i), SIGTERM);
+    }
+    g_mutex_unlock (&children_mutex);
+    fprintf (stderr, "ERROR: Aborted (%s).\n\n", strsignal (sig));
+    _exit (128 + sig);
+  }
+  return NULL;
+}
+
+/* Block termination signals and start the signal handling thread.
+ * Must be called before any other threads are started, so that they
+ * inherit the signal mask. */
+void
+saw_shutdown_init (void)
+{
+  sigset_t set = saw_shutdown_sigset ();
+  pthread_sigmask (SIG_BLOCK, &set, NULL);
+  children = g_array_new (FALSE, FALSE, sizeof (GPid));
+  g_thread_unref (g_thread_new ("signal", saw_shutdown_thread, NULL));
+}
+
+/* Check whether a termination signal has been received. */
+gboolean
+saw_shutdown_requested (void)
+{
+  return g_atomic_int_get (&shutdown_signal) != 0;
+}
+
+/* Record a running child process, which must be a process group
+ * leader, so that it can be killed on abort. */
+void
+saw_shutdown_add_child (GPid pid)
+{
+  g_mutex_lock (&children_mutex);
+  if (children != NULL) g_array_append_val (children, pid);
+  g_mutex_unlock (&children_mutex);
+}
+
+void
+saw_shutdown_remove_child (GPid pid)
+{
+  g_mutex_lock (&children_mutex);
+  for (guint i = 0; children != NULL && i < children->len; i++) {
+    if (g_array_index (children, GPid, i) != pid) continue;
+    g_array_remove_index_fast (children, i);
+    break;
+  }
+  g_mutex_unlock (&children_mutex);
+}
+
+/* If a termination signal was received, report how much was written,
+ * and then exit with the signal's default action.  Otherwise, do
+ * nothing.  Call after output has been finished. */
+void
+saw_shutdown_exit_if_requested (guint64 num_records)
+{
+  int sig = g_atomic_int_get (&shutdown_signal);
+  if (sig == 0) return;
+
+  fprintf (stderr, "Interrupted (%s) after %" G_GUINT64_FORMAT
+           " records; partial results written.\n", strsignal (sig),
+           num_records);
+
+  sigset_t set;
+  sigemptyset (&set);
+  sigaddset (&set, sig);
+  signal (sig, SIG_DFL);
+  pthread_sigmask (SIG_UNBLOCK, &set, NULL);
+  raise (sig);
+  exit (128 + sig);
+}
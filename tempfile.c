@@ -0,0 +1,120 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#ifdef HAVE_MEMFD_CREATE
+#  include <sys/mman.h>
+#endif
+
+#include "ridge-saw.h"
+
+/* Temporary files for passing data to and from ridgetool.
+ *
+ * Where possible, an anonymous in-memory file is created with
+ * memfd_create(), and other programs are given its /proc/PID/fd/N
+ * path.  The path refers to ridge-saw's descriptor, so it stays valid
+ * in child processes even though the descriptor itself isn't
+ * inherited.  Otherwise, a file is created securely with mkostemp() in
+ * $TMPDIR, /dev/shm (which is usually a tmpfs) or the system temporary
+ * directory, in that order.
+ *
+ * Either way, the file is never created in the current directory,
+ * which may be on a slow network filesystem. */
+
+static SawTempFile *
+saw_temp_file_new_memfd (void)
+{
+#ifdef HAVE_MEMFD_CREATE
+  int fd = memfd_create ("ridge-saw", MFD_CLOEXEC);
+  if (fd == -1) return NULL;
+
+  SawTempFile *tmp = g_new0 (SawTempFile, 1);
+  tmp->fd = fd;
+  tmp->path = g_strdup_printf ("/proc/%li/fd/%i", (long) getpid (), fd);
+
+  /* Check that /proc is available */
+  if (access (tmp->path, R_OK | W_OK) == 0) return tmp;
+
+  close (fd);
+  g_free (tmp->path);
+  g_free (tmp);
+#endif
+  return NULL;
+}
+
+/* Create a temporary file.  Returns NULL and sets errno on failure. */
+SawTempFile *
+saw_temp_file_new (void)
+{
+  SawTempFile *tmp = saw_temp_file_new_memfd ();
+  if (tmp != NULL) return tmp;
+
+  const gchar *dirs[] = {g_getenv ("TMPDIR"), "/dev/shm", g_get_tmp_dir ()};
+  int saved_errno = 0;
+
+  for (unsigned int i = 0; i < G_N_ELEMENTS (dirs); i++) {
+    if (dirs[i] == NULL || !g_file_test (dirs[i], G_FILE_TEST_IS_DIR)) {
+      continue;
+    }
+    gchar *path = g_build_filename (dirs[i], "ridge-saw.XXXXXX", NULL);
+#ifdef HAVE_MKOSTEMP
+    /* Set close-on-exec atomically, since other threads may be
+     * starting ridgetool at the same time. */
+    int fd = mkostemp (path, O_CLOEXEC);
+#else
+    int fd = mkstemp (path);
+    if (fd != -1 && fcntl (fd, F_SETFD, FD_CLOEXEC) == -1) {
+      int err = errno;
+      unlink (path);
+      close (fd);
+      errno = err;
+      fd = -1;
+    }
+#endif
+    if (fd == -1) {
+      saved_errno = errno;
+      g_free (path);
+      continue;
+    }
+
+    tmp = g_new0 (SawTempFile, 1);
+    tmp->fd = fd;
+    tmp->path = path;
+    tmp->named = TRUE;
+    return tmp;
+  }
+
+  errno = saved_errno;
+  return NULL;
+}
+
+/* Close and remove a temporary file. */
+void
+saw_temp_file_free (SawTempFile *tmp)
+{
+  if (tmp == NULL) return;
+  if (tmp->named) unlink (tmp->path);
+  close (tmp->fd);
+  g_free (tmp->path);
+  g_free (tmp);
+}
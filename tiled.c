@@ -0,0 +1,618 @@
+/*
+ * Surrey Space Centre ridge/self-avoiding walk tool
+ * Copyright (C) 2012  Peter Brett <p.brett@surrey.ac.uk>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "config.h"
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <tiffio.h>
+#include <ridgeutil.h>
+#include <ridgeio.h>
+
+#include "ridge-saw.h"
+
+/* Tiled processing of images too large to load at once.
+ *
+ * The image is divided into a grid of square "core" regions.  Each
+ * tile is read from the TIFF file with an extra OVERLAP pixels on
+ * every side, and ridge detection is run on it.  Each detected line
+ * is then clipped to the tile's core region.  Since the cores
+ * partition the image, every part of every line is kept exactly once,
+ * and as long as the overlap is large compared to the detection
+ * scale, the parts near the seams between cores are detected well away
+ * from the edges of the tiles they came from.
+ *
+ * Lines lying entirely within a core are output straight away.  The
+ * pieces of lines that cross seams are collected, and once all tiles
+ * have been processed they are joined up end-to-end.  Each cut end of
+ * a piece remembers the next point of the line beyond the seam, and
+ * is joined to a piece from another tile that has a cut end at (or
+ * next to) that point.
+ *
+ * Each worker thread starts with a block of neighbouring tiles, and
+ * steals tiles from other workers when it runs out (see sched.c).
+ * Each worker has its own TIFF handle and temporary file, so memory
+ * use depends only on the tile size and the number of threads. */
+
+typedef struct _TiledSource TiledSource;
+typedef struct _TiledJob TiledJob;
+typedef struct _TiledWorker TiledWorker;
+typedef struct _TiledPiece TiledPiece;
+typedef gint32 TiledPoint[2]; /* (row, col) */
+
+struct _TiledSource
+{
+  TIFF *tif;
+  guint32 width, height;
+  guint16 bits, format;
+  int tiled;
+  guint32 chunk_w, chunk_h; /* Size of TIFF tiles or strips */
+  tmsize_t chunk_size;
+  guint8 *chunk;            /* Decoded tile or strip, allocated by
+                             * the first read */
+  gint64 chunk_index;       /* Index of decoded tile or strip */
+};
+
+struct _TiledPiece
+{
+  gint32 start[2], end[2];         /* First and last points (row, col) */
+  gint32 start_next[2], end_next[2]; /* Points beyond cut ends */
+  int num_points;
+  int tile;
+  guint8 start_cut, end_cut;
+  gint32 link[2];  /* Piece end joined to each end, as 2 * piece +
+                    * end, or -1 */
+};
+
+struct _TiledJob
+{
+  const char *filename;
+  int tile_size;
+  int overlap;
+  float scale;
+  SawPrecision precision;
+  guint32 width, height;
+  int tile_rows, tile_cols;
+  SawOutput *out;
+  TiledWorker *workers;
+
+  volatile gint failed;
+  guint8 *done;      /* Whether each tile was processed */
+
+  GMutex mutex;
+  GArray *pieces;
+};
+
+struct _TiledWorker
+{
+  TiledJob *job;
+  TiledSource *src;
+  SawTempFile *tmp;
+};
+
+/* ---------------------------------------------------------------- */
+/* TIFF input */
+
+static TiledSource *
+tiled_source_open (const char *filename)
+{
+  TIFF *tif = TIFFOpen (filename, "r");
+  if (tif == NULL) return NULL;
+
+  TiledSource *src = g_new0 (TiledSource, 1);
+  guint16 spp = 1;
+  src->tif = tif;
+  TIFFGetField (tif, TIFFTAG_IMAGEWIDTH, &src->width);
+  TIFFGetField (tif, TIFFTAG_IMAGELENGTH, &src->height);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_BITSPERSAMPLE, &src->bits);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLEFORMAT, &src->format);
+  TIFFGetFieldDefaulted (tif, TIFFTAG_SAMPLESPERPIXEL, &spp);
+
+  src->tiled = TIFFIsTiled (tif);
+  if (src->tiled) {
+    TIFFGetField (tif, TIFFTAG_TILEWIDTH, &src->chunk_w);
+    TIFFGetField (tif, TIFFTAG_TILELENGTH, &src->chunk_h);
+    src->chunk_size = TIFFTileSize (tif);
+  } else {
+    src->chunk_w = src->width;
+    TIFFGetFieldDefaulted (tif, TIFFTAG_ROWSPERSTRIP, &src->chunk_h);
+    src->chunk_h = MIN (src->chunk_h, src->height);
+    src->chunk_size = TIFFStripSize (tif);
+  }
+  src->chunk_index = -1;
+
+  /* Only single-channel integer and floating point data is
+   * supported. */
+  int ok = (spp == 1);
+  switch (src->format) {
+  case SAMPLEFORMAT_UINT:
+  case SAMPLEFORMAT_INT:
+    ok = ok && (src->bits == 8 || src->bits == 16 || src->bits == 32);
+    break;
+  case SAMPLEFORMAT_IEEEFP:
+    ok = ok && (src->bits == 32 || src->bits == 64);
+    break;
+  default:
+    ok = 0;
+  }
+  if (!ok) {
+    fprintf (stderr, "ERROR: Unsupported image format in '%s'.\n\n",
+             filename);
+    exit (2);
+  }
+  return src;
+}
+
+static void
+tiled_source_close (TiledSource *src)
+{
+  if (src == NULL) return;
+  TIFFClose (src->tif);
+  g_free (src->chunk);
+  g_free (src);
+}
+
+static inline float
+tiled_source_sample (const TiledSource *src, size_t i)
+{
+  switch (src->format) {
+  case SAMPLEFORMAT_UINT:
+    switch (src->bits) {
+    case 8: return ((guint8 *) src->chunk)[i];
+    case 16: return ((guint16 *) src->chunk)[i];
+    default: return ((guint32 *) src->chunk)[i];
+    }
+  case SAMPLEFORMAT_INT:
+    switch (src->bits) {
+    case 8: return ((gint8 *) src->chunk)[i];
+    case 16: return ((gint16 *) src->chunk)[i];
+    default: return ((gint32 *) src->chunk)[i];
+    }
+  default:
+    if (src->bits == 32) return ((float *) src->chunk)[i];
+    return ((double *) src->chunk)[i];
+  }
+}
+
+/* Read the region of rows x cols pixels with top left corner at (row,
+ * col) into img.  Returns 0 on failure. */
+static int
+tiled_source_read (TiledSource *src, guint32 row, guint32 col,
+                   RutSurface *img)
+{
+  guint32 rows = img->rows, cols = img->cols;
+
+  for (guint32 cr = row / src->chunk_h;
+       cr * src->chunk_h < row + rows; cr++) {
+    for (guint32 cc = col / src->chunk_w;
+         cc * src->chunk_w < col + cols; cc++) {
+      guint32 r0 = cr * src->chunk_h, c0 = cc * src->chunk_w;
+
+      /* Decode the tile or strip, if it's not already loaded */
+      gint64 index;
+      tmsize_t status;
+      if (src->tiled) {
+        index = TIFFComputeTile (src->tif, c0, r0, 0, 0);
+      } else {
+        index = TIFFComputeStrip (src->tif, r0, 0);
+      }
+      if (index != src->chunk_index) {
+        /* Allocated here rather than when opening, so that a worker's
+         * buffer is first touched on its own NUMA node */
+        if (src->chunk == NULL) src->chunk = g_malloc (src->chunk_size);
+        if (src->tiled) {
+          status = TIFFReadEncodedTile (src->tif, index, src->chunk, -1);
+        } else {
+          status = TIFFReadEncodedStrip (src->tif, index, src->chunk, -1);
+        }
+        if (status < 0) return 0;
+        src->chunk_index = index;
+      }
+
+      /* Copy the intersection with the region */
+      guint32 i0 = MAX (r0, row), i1 = MIN (r0 + src->chunk_h, row + rows);
+      guint32 j0 = MAX (c0, col), j1 = MIN (c0 + src->chunk_w, col + cols);
+      for (guint32 i = i0; i < i1; i++) {
+        size_t base = (size_t) (i - r0) * src->chunk_w;
+        for (guint32 j = j0; j < j1; j++) {
+          RUT_SURFACE_REF (img, i - row, j - col) =
+            tiled_source_sample (src, base + (j - c0));
+        }
+      }
+    }
+  }
+  return 1;
+}
+
+/* ---------------------------------------------------------------- */
+/* Tile processing */
+
+static void
+tiled_job_core (const TiledJob *job, int tile, guint32 *r0, guint32 *c0,
+                guint32 *r1, guint32 *c1)
+{
+  *r0 = (tile / job->tile_cols) * (guint32) job->tile_size;
+  *c0 = (tile % job->tile_cols) * (guint32) job->tile_size;
+  *r1 = MIN (*r0 + job->tile_size, job->height);
+  *c1 = MIN (*c0 + job->tile_size, job->width);
+}
+
+/* Clip a detected line to the tile's core region.  Complete lines are
+ * output; pieces cut by seams are saved for stitching. */
+static int
+tiled_clip_line (TiledWorker *w, int tile, const SawLines *lines, guint line,
+                 guint32 off_row, guint32 off_col)
+{
+  TiledJob *job = w->job;
+  guint32 r0, c0, r1, c1;
+  tiled_job_core (job, tile, &r0, &c0, &r1, &c1);
+
+  const gint32 *p = &lines->points[2 * lines->offsets[line]];
+  int len = lines->offsets[line+1] - lines->offsets[line];
+  TiledPoint *pts = g_new (TiledPoint, len);
+  for (int i = 0; i < len; i++) {
+    pts[i][0] = p[2*i] + off_row;
+    pts[i][1] = p[2*i + 1] + off_col;
+  }
+
+#define IN_CORE(p) ((p)[0] >= (gint32) r0 && (p)[0] < (gint32) r1 \
+                    && (p)[1] >= (gint32) c0 && (p)[1] < (gint32) c1)
+
+  int status = 1;
+  int i = 0;
+  while (i < len) {
+    if (!IN_CORE (pts[i])) { i++; continue; }
+    int start = i;
+    while (i < len && IN_CORE (pts[i])) i++;
+    int end = i - 1;
+
+    if (start == 0 && end == len - 1) {
+      /* Complete line */
+      status = saw_output_record (job->out, len - 1,
+                                  pts[end][1] - pts[0][1],
+                                  pts[end][0] - pts[0][0], 1);
+      break;
+    }
+
+    TiledPiece p;
+    memset (&p, 0, sizeof (p));
+    memcpy (p.start, pts[start], sizeof (p.start));
+    memcpy (p.end, pts[end], sizeof (p.end));
+    p.num_points = end - start + 1;
+    p.tile = tile;
+    p.start_cut = (start > 0);
+    p.end_cut = (end < len - 1);
+    if (p.start_cut) memcpy (p.start_next, pts[start-1], sizeof (p.start));
+    if (p.end_cut) memcpy (p.end_next, pts[end+1], sizeof (p.end));
+    p.link[0] = p.link[1] = -1;
+
+    g_mutex_lock (&job->mutex);
+    g_array_append_val (job->pieces, p);
+    g_mutex_unlock (&job->mutex);
+    saw_mem_charge (sizeof (TiledPiece));
+  }
+#undef IN_CORE
+
+  g_free (pts);
+  return status;
+}
+
+static int
+tiled_process_tile (TiledWorker *w, int tile)
+{
+  TiledJob *job = w->job;
+  guint32 r0, c0, r1, c1;
+  tiled_job_core (job, tile, &r0, &c0, &r1, &c1);
+
+  /* Extend the core by the overlap, within the image */
+  guint32 er0 = (r0 > (guint32) job->overlap) ? r0 - job->overlap : 0;
+  guint32 ec0 = (c0 > (guint32) job->overlap) ? c0 - job->overlap : 0;
+  guint32 er1 = MIN (r1 + job->overlap, job->height);
+  guint32 ec1 = MIN (c1 + job->overlap, job->width);
+
+  /* Wait for room for the image data, both in memory and in the
+   * temporary file, and for the lines */
+  gsize pixels = (gsize) (er1 - er0) * (ec1 - ec0);
+  gsize pixel_size = sizeof (float) + saw_precision_pixel_size (job->precision);
+  gsize room = saw_mem_begin_tile (pixels * pixel_size);
+
+  RutSurface *img = saw_surface_new (er1 - er0, ec1 - ec0);
+  if (!tiled_source_read (w->src, er0, ec0, img)) {
+    fprintf (stderr, "ERROR: Failed to read image data from '%s'.\n\n",
+             job->filename);
+    exit (2);
+  }
+  if (!saw_surface_to_tiff (img, w->tmp->path, job->precision)) {
+    fprintf (stderr, "ERROR: Failed to write image data to '%s'.\n\n",
+             w->tmp->path);
+    exit (5);
+  }
+  saw_surface_free (img);
+
+  /* Tiles are only processed once, so don't bother with the cache,
+   * which would otherwise fill up with tiles and push out whole
+   * images. */
+  RioData *data = run_ridgetool_get_data (w->tmp->path, job->scale);
+  SawLines *lines = saw_lines_from_rio_data (data);
+  rio_data_destroy (data);
+  int status = 1;
+  for (guint i = 0; status && i < lines->num_lines; i++) {
+    status = tiled_clip_line (w, tile, lines, i, er0, ec0);
+  }
+  saw_lines_free (lines);
+  saw_mem_end_tile (room);
+  return status;
+}
+
+static void
+tiled_tile_task (SawScheduler *sched, int worker, gpointer data,
+                 gpointer user_data)
+{
+  TiledJob *job = (TiledJob *) user_data;
+  int tile = GPOINTER_TO_INT (data);
+
+  /* On shutdown, skip the remaining tiles, but finish the ones in
+   * progress. */
+  if (g_atomic_int_get (&job->failed) || saw_shutdown_requested ()) return;
+  if (tiled_process_tile (&job->workers[worker], tile)) {
+    job->done[tile] = 1;
+  } else {
+    g_atomic_int_set (&job->failed, 1);
+  }
+}
+
+/* ---------------------------------------------------------------- */
+/* Stitching */
+
+static inline guint64
+tiled_point_key (const gint32 *p)
+{
+  return ((guint64) (guint32) p[0] << 32) | (guint32) p[1];
+}
+
+/* Find a cut piece end from another tile, lying at or next to the
+ * point beyond the given cut end, and pointing back towards it. */
+static gint32
+tiled_find_link (GArray *pieces, GHashTable *ends, int piece, int end)
+{
+  TiledPiece *p = &g_array_index (pieces, TiledPiece, piece);
+  const gint32 *pt = end ? p->end : p->start;
+  const gint32 *next = end ? p->end_next : p->start_next;
+  gint32 best = -1;
+  int best_dist = G_MAXINT;
+
+  for (int di = -1; di <= 1; di++) {
+    for (int dj = -1; dj <= 1; dj++) {
+      gint32 q[2] = {next[0] + di, next[1] + dj};
+      guint64 key = tiled_point_key (q);
+      GArray *list = g_hash_table_lookup (ends, &key);
+      if (list == NULL) continue;
+
+      for (guint k = 0; k < list->len; k++) {
+        gint32 ref = g_array_index (list, gint32, k);
+        TiledPiece *o = &g_array_index (pieces, TiledPiece, ref / 2);
+        if (o->tile == p->tile || o->link[ref % 2] >= 0) continue;
+
+        const gint32 *onext = (ref % 2) ? o->end_next : o->start_next;
+        if (ABS (onext[0] - pt[0]) > 1 || ABS (onext[1] - pt[1]) > 1) {
+          continue;
+        }
+        int dist = ABS (di) + ABS (dj);
+        if (dist < best_dist) {
+          best = ref;
+          best_dist = dist;
+        }
+      }
+    }
+  }
+  return best;
+}
+
+/* Check whether a piece end is cut off by a tile that wasn't
+ * processed because of a shutdown, so that the line may continue. */
+static gboolean
+tiled_end_pending (const TiledJob *job, const TiledPiece *p, int end)
+{
+  if (!(end ? p->end_cut : p->start_cut) || p->link[end] >= 0) return FALSE;
+  const gint32 *next = end ? p->end_next : p->start_next;
+  int tile = ((next[0] / job->tile_size) * job->tile_cols
+              + next[1] / job->tile_size);
+  return !job->done[tile];
+}
+
+/* Join up pieces of lines, and output the resulting lines.  Lines
+ * that may continue into unprocessed tiles are dropped. */
+static int
+tiled_stitch (TiledJob *job)
+{
+  GArray *pieces = job->pieces;
+  GHashTable *ends = g_hash_table_new_full (g_int64_hash, g_int64_equal,
+                                            g_free,
+                                            (GDestroyNotify) g_array_unref);
+
+  /* Index cut ends by position */
+  for (guint i = 0; i < pieces->len; i++) {
+    TiledPiece *p = &g_array_index (pieces, TiledPiece, i);
+    for (int end = 0; end < 2; end++) {
+      if (!(end ? p->end_cut : p->start_cut)) continue;
+      guint64 key = tiled_point_key (end ? p->end : p->start);
+      GArray *list = g_hash_table_lookup (ends, &key);
+      if (list == NULL) {
+        list = g_array_new (FALSE, FALSE, sizeof (gint32));
+        guint64 *k = g_new (guint64, 1);
+        *k = key;
+        g_hash_table_insert (ends, k, list);
+      }
+      gint32 ref = 2 * i + end;
+      g_array_append_val (list, ref);
+    }
+  }
+
+  /* Link each cut end to its continuation */
+  for (guint i = 0; i < pieces->len; i++) {
+    for (int end = 0; end < 2; end++) {
+      TiledPiece *p = &g_array_index (pieces, TiledPiece, i);
+      if (!(end ? p->end_cut : p->start_cut) || p->link[end] >= 0) continue;
+      gint32 ref = tiled_find_link (pieces, ends, i, end);
+      if (ref < 0) continue;
+      p->link[end] = ref;
+      g_array_index (pieces, TiledPiece, ref / 2).link[ref % 2] = 2 * i + end;
+    }
+  }
+  g_hash_table_destroy (ends);
+
+  /* Follow chains of linked pieces.  Chains are started from pieces
+   * with a free end first; anything left over is a closed loop, which
+   * is broken at an arbitrary piece. */
+  guint8 *visited = g_new0 (guint8, pieces->len);
+  int status = 1;
+  for (int pass = 0; pass < 2 && status; pass++) {
+    for (guint i = 0; i < pieces->len && status; i++) {
+      TiledPiece *p = &g_array_index (pieces, TiledPiece, i);
+      if (visited[i]) continue;
+
+      int enter = (p->link[0] < 0) ? 0 : (p->link[1] < 0) ? 1 : -1;
+      if (enter < 0) {
+        if (pass == 0) continue;
+        enter = 0;
+      }
+
+      const gint32 *first = enter ? p->end : p->start;
+      const gint32 *last = first;
+      int num_points = 0;
+      int complete = !tiled_end_pending (job, p, enter);
+      gint32 piece = i;
+      while (piece >= 0 && !visited[piece]) {
+        TiledPiece *q = &g_array_index (pieces, TiledPiece, piece);
+        visited[piece] = 1;
+        num_points += q->num_points;
+        last = enter ? q->start : q->end;
+        gint32 next = q->link[!enter];
+        if (next < 0 && tiled_end_pending (job, q, !enter)) complete = 0;
+        piece = (next < 0) ? -1 : next / 2;
+        enter = (next < 0) ? 0 : next % 2;
+      }
+
+      if (!complete) continue;
+      status = saw_output_record (job->out, num_points - 1,
+                                  last[1] - first[1], last[0] - first[0], 1);
+    }
+  }
+  g_free (visited);
+  return status;
+}
+
+/* ---------------------------------------------------------------- */
+
+/* Detect lines in a large image file by processing it in tiles of
+ * tile_size pixels, each extended by overlap pixels on every side,
+ * using num_threads threads.  Returns 0 on output failure. */
+int
+tiled_process_file (const char *filename, int tile_size, int overlap,
+                    float scale, SawPrecision precision, int num_threads,
+                    SawOutput *out)
+{
+  g_assert (filename);
+  g_assert (tile_size > 0 && overlap >= 0);
+  g_assert (num_threads > 0);
+  g_assert (out);
+
+  TiledSource *src = tiled_source_open (filename);
+  if (src == NULL) {
+    fprintf (stderr, "ERROR: Failed to open image file '%s'.\n\n",
+             filename);
+    exit (2);
+  }
+
+  TiledJob job;
+  memset (&job, 0, sizeof (job));
+  job.filename = filename;
+  job.tile_size = tile_size;
+  job.overlap = overlap;
+  job.scale = scale;
+  job.precision = precision;
+  job.width = src->width;
+  job.height = src->height;
+  job.tile_rows = (job.height + tile_size - 1) / tile_size;
+  job.tile_cols = (job.width + tile_size - 1) / tile_size;
+  job.out = out;
+  job.pieces = g_array_new (FALSE, FALSE, sizeof (TiledPiece));
+  g_mutex_init (&job.mutex);
+  int num_tiles = job.tile_rows * job.tile_cols;
+  job.done = g_new0 (guint8, num_tiles);
+  num_threads = MIN (num_threads, num_tiles);
+
+  job.workers = g_new0 (TiledWorker, num_threads);
+  for (int i = 0; i < num_threads; i++) {
+    TiledWorker *w = &job.workers[i];
+    w->job = &job;
+    w->src = (i == 0) ? src : tiled_source_open (filename);
+    if (w->src == NULL) {
+      /* Carry on with the workers that could open the file */
+      fprintf (stderr, "WARNING: Failed to open image file '%s' for "
+               "worker %i; using %i workers.\n", filename, i, i);
+      num_threads = i;
+      break;
+    }
+
+    w->tmp = saw_temp_file_new ();
+    if (w->tmp == NULL) {
+      const char *msg = errno ? strerror (errno) : "Unexpected error";
+      fprintf (stderr, "ERROR: Failed to create temporary file: %s\n\n",
+               msg);
+      exit (5);
+    }
+  }
+
+  /* Give each worker a block of consecutive tiles, queued in reverse
+   * so that it works through them in order, reading the TIFF file
+   * sequentially, while thieves take tiles from the far end. */
+  SawScheduler *sched = saw_scheduler_new (num_threads, &job);
+  for (int tile = num_tiles - 1; tile >= 0; tile--) {
+    saw_scheduler_push (sched, (gint64) tile * num_threads / num_tiles,
+                        tiled_tile_task, GINT_TO_POINTER (tile));
+  }
+  saw_scheduler_run (sched);
+  saw_scheduler_report (sched, stderr);
+  saw_scheduler_free (sched);
+
+  for (int i = 0; i < num_threads; i++) {
+    TiledWorker *w = &job.workers[i];
+    tiled_source_close (w->src);
+    saw_temp_file_free (w->tmp);
+  }
+  g_free (job.workers);
+
+  int num_done = 0;
+  for (int i = 0; i < num_tiles; i++) num_done += job.done[i];
+  if (num_done < num_tiles) {
+    fprintf (stderr, "Processed %i of %i tiles of '%s'\n",
+             num_done, num_tiles, filename);
+  }
+
+  int status = !job.failed && tiled_stitch (&job);
+
+  g_free (job.done);
+  saw_mem_credit (job.pieces->len * sizeof (TiledPiece));
+  g_array_free (job.pieces, TRUE);
+  g_mutex_clear (&job.mutex);
+  return status;
+}